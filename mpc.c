@@ -98,8 +98,122 @@ typedef struct {
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
+  size_t mem_size;
+
 } mpc_input_t;
 
+/*
+** Memory Statistics
+**
+** Everything an input allocates for itself or through mpc_malloc is
+** counted. Heap blocks from mpc_malloc are remembered along with their
+** size so that mpc_free, mpc_realloc and mpc_export can subtract exactly
+** what was added. Results stop being counted once they are exported.
+*/
+
+typedef struct {
+  void *p;
+  size_t n;
+} mpc_mem_block_t;
+
+static mpc_mem_block_t *mpc_mem_blocks = NULL;
+static size_t mpc_mem_blocks_slots = 0;
+static size_t mpc_mem_blocks_num = 0;
+
+static size_t mpc_mem_live = 0;
+static size_t mpc_mem_peak = 0;
+static size_t mpc_mem_total = 0;
+
+static void mpc_mem_add(size_t n) {
+  mpc_mem_live += n;
+  mpc_mem_total += n;
+  if (mpc_mem_live > mpc_mem_peak) { mpc_mem_peak = mpc_mem_live; }
+}
+
+static void mpc_mem_sub(size_t n) {
+  mpc_mem_live -= n;
+}
+
+static size_t mpc_mem_block_index(void *p) {
+  return (((size_t)p >> 4) * 2654435761u) & (mpc_mem_blocks_slots - 1);
+}
+
+static void mpc_mem_track(void *p, size_t n);
+
+static void mpc_mem_blocks_grow(void) {
+  size_t j;
+  mpc_mem_block_t *old = mpc_mem_blocks;
+  size_t old_slots = mpc_mem_blocks_slots;
+  mpc_mem_blocks_slots = old_slots ? old_slots * 2 : 64;
+  mpc_mem_blocks = calloc(mpc_mem_blocks_slots, sizeof(mpc_mem_block_t));
+  mpc_mem_blocks_num = 0;
+  for (j = 0; j < old_slots; j++) {
+    if (old[j].p) { mpc_mem_track(old[j].p, old[j].n); }
+  }
+  free(old);
+}
+
+static void mpc_mem_track(void *p, size_t n) {
+  size_t j;
+  if ((mpc_mem_blocks_num + 1) * 2 > mpc_mem_blocks_slots) { mpc_mem_blocks_grow(); }
+  j = mpc_mem_block_index(p);
+  while (mpc_mem_blocks[j].p) { j = (j + 1) & (mpc_mem_blocks_slots - 1); }
+  mpc_mem_blocks[j].p = p;
+  mpc_mem_blocks[j].n = n;
+  mpc_mem_blocks_num++;
+}
+
+/* Returns the size 'p' was tracked with, or zero if it was not */
+static size_t mpc_mem_untrack(void *p) {
+  size_t j, k, h, n;
+  if (p == NULL || mpc_mem_blocks_num == 0) { return 0; }
+  j = mpc_mem_block_index(p);
+  while (mpc_mem_blocks[j].p != p) {
+    if (!mpc_mem_blocks[j].p) { return 0; }
+    j = (j + 1) & (mpc_mem_blocks_slots - 1);
+  }
+  n = mpc_mem_blocks[j].n;
+  mpc_mem_blocks_num--;
+
+  /* Shift later entries of the probe run back so no tombstone is needed */
+  k = j;
+  for (;;) {
+    k = (k + 1) & (mpc_mem_blocks_slots - 1);
+    if (!mpc_mem_blocks[k].p) { break; }
+    h = mpc_mem_block_index(mpc_mem_blocks[k].p);
+    if ((j < k) ? (h <= j || h > k) : (h <= j && h > k)) {
+      mpc_mem_blocks[j] = mpc_mem_blocks[k];
+      j = k;
+    }
+  }
+  mpc_mem_blocks[j].p = NULL;
+  return n;
+}
+
+void mpc_mem_stats(mpc_mem_stats_t *s) {
+  s->live = mpc_mem_live;
+  s->peak = mpc_mem_peak;
+  s->total = mpc_mem_total;
+}
+
+/* Bytes owned by an input. Its block pool is part of mpc_input_t, so blocks
+   handed out from the pool are not counted again */
+static size_t mpc_input_size(mpc_input_t *i) {
+  size_t n = sizeof(mpc_input_t) + strlen(i->filename) + 1;
+  n += (sizeof(mpc_state_t) + sizeof(char)) * i->marks_slots;
+  if (i->string) { n += strlen(i->string) + 1; }
+  if (i->buffer) { n += strlen(i->buffer) + 1; }
+  return n;
+}
+
+/* Brings the statistics up to date after the input grew or shrank */
+static void mpc_input_resized(mpc_input_t *i) {
+  size_t n = mpc_input_size(i);
+  mpc_mem_sub(i->mem_size);
+  mpc_mem_add(n);
+  i->mem_size = n;
+}
+
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -126,6 +240,9 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->mem_size = 0;
+  mpc_input_resized(i);
+
   return i;
 }
 
@@ -156,6 +273,9 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->mem_size = 0;
+  mpc_input_resized(i);
+
   return i;
 
 }
@@ -185,6 +305,9 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->mem_size = 0;
+  mpc_input_resized(i);
+
   return i;
 
 }
@@ -213,11 +336,16 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->mem_size = 0;
+  mpc_input_resized(i);
+
   return i;
 }
 
 static void mpc_input_delete(mpc_input_t *i) {
 
+  mpc_mem_sub(i->mem_size);
+
   free(i->filename);
 
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
@@ -238,7 +366,7 @@ static void *mpc_malloc(mpc_input_t *i, size_t n) {
   size_t j;
   char *p;
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  if (n > sizeof(mpc_mem_t)) { goto heap; }
 
   j = i->mem_index;
   do {
@@ -251,7 +379,11 @@ static void *mpc_malloc(mpc_input_t *i, size_t n) {
     i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
   } while (j != i->mem_index);
 
-  return malloc(n);
+heap:
+  p = malloc(n);
+  mpc_mem_track(p, n);
+  mpc_mem_add(n);
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -262,7 +394,11 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 
 static void mpc_free(mpc_input_t *i, void *p) {
   size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
+  if (!mpc_mem_ptr(i, p)) {
+    mpc_mem_sub(mpc_mem_untrack(p));
+    free(p);
+    return;
+  }
   j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
   i->mem_full[j] = 0;
 }
@@ -271,10 +407,18 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
   char *q = NULL;
 
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
+  if (!mpc_mem_ptr(i, p)) {
+    mpc_mem_sub(mpc_mem_untrack(p));
+    q = realloc(p, n);
+    mpc_mem_track(q, n);
+    mpc_mem_add(n);
+    return q;
+  }
 
   if (n > sizeof(mpc_mem_t)) {
     q = malloc(n);
+    mpc_mem_track(q, n);
+    mpc_mem_add(n);
     memcpy(q, p, sizeof(mpc_mem_t));
     mpc_free(i, p);
     return q;
@@ -285,7 +429,10 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
+  if (!mpc_mem_ptr(i, p)) {
+    mpc_mem_sub(mpc_mem_untrack(p));
+    return p;
+  }
   q = malloc(sizeof(mpc_mem_t));
   memcpy(q, p, sizeof(mpc_mem_t));
   mpc_free(i, p);
@@ -308,6 +455,7 @@ static void mpc_input_mark(mpc_input_t *i) {
     i->marks_slots = i->marks_num + i->marks_num / 2;
     i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+    mpc_input_resized(i);
   }
 
   i->marks[i->marks_num-1] = i->state;
@@ -315,6 +463,7 @@ static void mpc_input_mark(mpc_input_t *i) {
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
     i->buffer = calloc(1, 1);
+    mpc_input_resized(i);
   }
 
 }
@@ -333,6 +482,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
       i->marks_num : MPC_INPUT_MARKS_MIN;
     i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+    mpc_input_resized(i);
   }
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
@@ -341,6 +491,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
 
     free(i->buffer);
     i->buffer = NULL;
+    mpc_input_resized(i);
   }
 
 }
@@ -459,6 +610,7 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
     i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
     i->buffer[strlen(i->buffer) + 1] = '\0';
     i->buffer[strlen(i->buffer) + 0] = c;
+    mpc_input_resized(i);
   }
 
   i->last = c;
@@ -2868,6 +3020,193 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 }
 
 
+/*
+** Tags
+**
+** Each distinct tag is stored once. A single rule name is one entry, and
+** a longer tag is an entry pairing its first name with the ID of the rest,
+** looked up by that pair so equal tags always share an ID. Strings for
+** longer tags are only joined together when first asked for. The table
+** is counted in mpc_mem_stats and freed by mpc_tags_cleanup.
+*/
+
+typedef struct {
+  int head;
+  int rest;
+  unsigned long hash;
+  char *str;
+} mpc_tag_t;
+
+static mpc_tag_t *mpc_tags = NULL;
+static int mpc_tags_num = 0;
+static int mpc_tags_max = 0;
+static int *mpc_tags_table = NULL;
+static int mpc_tags_slots = 0;
+
+static unsigned long mpc_tag_hash_name(const char *s, size_t n) {
+  unsigned long h = 5381;
+  size_t i;
+  for (i = 0; i < n; i++) { h = h * 33 + (unsigned char)s[i]; }
+  return h;
+}
+
+static unsigned long mpc_tag_hash_pair(int head, int rest) {
+  return ((unsigned long)head * 2654435761u) ^ ((unsigned long)rest * 40503u) ^ 0x9e3779b9u;
+}
+
+static void mpc_tags_grow(void) {
+  int i, j;
+  free(mpc_tags_table);
+  mpc_mem_sub(sizeof(int) * mpc_tags_slots);
+  mpc_tags_slots = mpc_tags_slots ? mpc_tags_slots * 2 : 64;
+  mpc_tags_table = malloc(sizeof(int) * mpc_tags_slots);
+  mpc_mem_add(sizeof(int) * mpc_tags_slots);
+  for (j = 0; j < mpc_tags_slots; j++) { mpc_tags_table[j] = -1; }
+  for (i = 0; i < mpc_tags_num; i++) {
+    j = mpc_tags[i].hash & (mpc_tags_slots - 1);
+    while (mpc_tags_table[j] != -1) { j = (j + 1) & (mpc_tags_slots - 1); }
+    mpc_tags_table[j] = i;
+  }
+}
+
+static int mpc_tag_add(unsigned long hash, int head, int rest, char *str) {
+  int j, id;
+  if ((mpc_tags_num + 1) * 2 > mpc_tags_slots) { mpc_tags_grow(); }
+  if (mpc_tags_num == mpc_tags_max) {
+    mpc_mem_sub(sizeof(mpc_tag_t) * mpc_tags_max);
+    mpc_tags_max = mpc_tags_max ? mpc_tags_max * 2 : 32;
+    mpc_tags = realloc(mpc_tags, sizeof(mpc_tag_t) * mpc_tags_max);
+    mpc_mem_add(sizeof(mpc_tag_t) * mpc_tags_max);
+  }
+  id = mpc_tags_num++;
+  mpc_tags[id].head = head < 0 ? id : head;
+  mpc_tags[id].rest = rest;
+  mpc_tags[id].hash = hash;
+  mpc_tags[id].str = str;
+  j = hash & (mpc_tags_slots - 1);
+  while (mpc_tags_table[j] != -1) { j = (j + 1) & (mpc_tags_slots - 1); }
+  mpc_tags_table[j] = id;
+  return id;
+}
+
+static int mpc_tag_name(const char *s, size_t n) {
+  unsigned long h = mpc_tag_hash_name(s, n);
+  char *str;
+  int j, id;
+  if (mpc_tags_slots) {
+    j = h & (mpc_tags_slots - 1);
+    while ((id = mpc_tags_table[j]) != -1) {
+      mpc_tag_t *t = &mpc_tags[id];
+      if (t->rest == -1 && t->hash == h
+      &&  strncmp(t->str, s, n) == 0 && t->str[n] == '\0') { return id; }
+      j = (j + 1) & (mpc_tags_slots - 1);
+    }
+  }
+  str = malloc(n + 1);
+  mpc_mem_add(n + 1);
+  memcpy(str, s, n);
+  str[n] = '\0';
+  return mpc_tag_add(h, -1, -1, str);
+}
+
+static int mpc_tag_pair(int head, int rest) {
+  unsigned long h;
+  int j, id;
+  if (rest < 0) { return head; }
+  h = mpc_tag_hash_pair(head, rest);
+  j = h & (mpc_tags_slots - 1);
+  while ((id = mpc_tags_table[j]) != -1) {
+    if (mpc_tags[id].head == head && mpc_tags[id].rest == rest) { return id; }
+    j = (j + 1) & (mpc_tags_slots - 1);
+  }
+  return mpc_tag_add(h, head, rest, NULL);
+}
+
+/* The tag for the names of 'a' followed by the names of 'b' */
+static int mpc_tag_append(int a, int b) {
+  int head = mpc_tags[a].head;
+  int rest = mpc_tags[a].rest;
+  if (rest < 0) { return mpc_tag_pair(head, b); }
+  return mpc_tag_pair(head, mpc_tag_append(rest, b));
+}
+
+/* As the strings did, drops the last character of 'parent' before 'child' */
+static int mpc_tag_root(int parent, int child) {
+  int head = mpc_tags[parent].head;
+  int rest = mpc_tags[parent].rest;
+  const char *name, *cs;
+  char *buf;
+  size_t n;
+  int id;
+
+  if (rest >= 0) { return mpc_tag_pair(head, mpc_tag_root(rest, child)); }
+
+  name = mpc_tags[parent].str;
+  n = strlen(name);
+  if (n <= 1) { return child; }
+
+  cs = mpc_tag_str(child);
+  buf = malloc(n - 1 + strlen(cs) + 1);
+  memcpy(buf, name, n - 1);
+  strcpy(buf + n - 1, cs);
+  id = mpc_tag_id(buf);
+  free(buf);
+  return id;
+}
+
+int mpc_tag_id(const char *tag) {
+  const char *bar = strchr(tag, '|');
+  if (bar == NULL) { return mpc_tag_name(tag, strlen(tag)); }
+  return mpc_tag_append(mpc_tag_name(tag, bar - tag), mpc_tag_id(bar + 1));
+}
+
+const char *mpc_tag_str(int id) {
+  mpc_tag_t *t = &mpc_tags[id];
+  const char *head, *rest;
+  if (t->str == NULL) {
+    head = mpc_tags[t->head].str;
+    rest = mpc_tag_str(t->rest);
+    t->str = malloc(strlen(head) + 1 + strlen(rest) + 1);
+    mpc_mem_add(strlen(head) + 1 + strlen(rest) + 1);
+    strcpy(t->str, head);
+    strcat(t->str, "|");
+    strcat(t->str, rest);
+  }
+  return t->str;
+}
+
+void mpc_tags_cleanup(void) {
+  int i;
+  for (i = 0; i < mpc_tags_num; i++) {
+    if (mpc_tags[i].str) {
+      mpc_mem_sub(strlen(mpc_tags[i].str) + 1);
+      free(mpc_tags[i].str);
+    }
+  }
+  mpc_mem_sub(sizeof(mpc_tag_t) * mpc_tags_max + sizeof(int) * mpc_tags_slots);
+  free(mpc_tags);
+  free(mpc_tags_table);
+  mpc_tags = NULL;
+  mpc_tags_table = NULL;
+  mpc_tags_num = 0;
+  mpc_tags_max = 0;
+  mpc_tags_slots = 0;
+}
+
+static mpc_val_t *mpcf_ast_tag_id(mpc_val_t *x, void *id) {
+  mpc_ast_t *a = x;
+  if (a == NULL) { return a; }
+  a->tag_id = (int)(size_t)id;
+  return a;
+}
+
+static mpc_val_t *mpcf_ast_add_tag_id(mpc_val_t *x, void *id) {
+  mpc_ast_t *a = x;
+  if (a == NULL) { return a; }
+  a->tag_id = mpc_tag_append((int)(size_t)id, a->tag_id);
+  return a;
+}
+
 /*
 ** AST
 */
@@ -2883,7 +3222,6 @@ void mpc_ast_delete(mpc_ast_t *a) {
   }
 
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
 
@@ -2891,7 +3229,6 @@ void mpc_ast_delete(mpc_ast_t *a) {
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
 }
@@ -2900,8 +3237,7 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
 
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  a->tag_id = mpc_tag_id(tag);
 
   a->contents = malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
@@ -2949,7 +3285,7 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 
   int i;
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (a->tag_id != b->tag_id) { return 0; }
   if (strcmp(a->contents, b->contents) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
 
@@ -2969,24 +3305,18 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  a->tag_id = mpc_tag_append(mpc_tag_id(t), a->tag_id);
   return a;
 }
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, (strlen(t)-1));
+  a->tag_id = mpc_tag_root(mpc_tag_id(t), a->tag_id);
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
+  a->tag_id = mpc_tag_id(t);
   return a;
 }
 
@@ -2996,6 +3326,19 @@ mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   return a;
 }
 
+/* Whether the single name 'id' is one of the names in the tag of 'a' */
+int mpc_ast_has_tag(mpc_ast_t *a, int id) {
+  int t;
+  for (t = a->tag_id; t >= 0; t = mpc_tags[t].rest) {
+    if (mpc_tags[t].head == id) { return 1; }
+  }
+  return 0;
+}
+
+const char *mpc_ast_get_tag(mpc_ast_t *a) {
+  return mpc_tag_str(a->tag_id);
+}
+
 static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
 
   int i;
@@ -3008,12 +3351,12 @@ static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
   for (i = 0; i < d; i++) { fprintf(fp, "  "); }
 
   if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
+    fprintf(fp, "%s:%lu:%lu '%s'\n", mpc_ast_get_tag(a),
       (long unsigned int)(a->state.row+1),
       (long unsigned int)(a->state.col+1),
       a->contents);
   } else {
-    fprintf(fp, "%s \n", a->tag);
+    fprintf(fp, "%s \n", mpc_ast_get_tag(a));
   }
 
   for (i = 0; i < a->children_num; i++) {
@@ -3036,9 +3379,10 @@ int mpc_ast_get_index(mpc_ast_t *ast, const char *tag) {
 
 int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
   int i;
+  int id = mpc_tag_id(tag);
 
   for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
+    if(ast->children[i]->tag_id == id) {
       return i;
     }
   }
@@ -3052,9 +3396,10 @@ mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag) {
 
 mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
   int i;
+  int id = mpc_tag_id(tag);
 
   for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
+    if(ast->children[i]->tag_id == id) {
       return ast->children[i];
     }
   }
@@ -3218,7 +3563,8 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      as[i]->children[0]->tag_id = mpc_tag_root(as[i]->tag_id, as[i]->children[0]->tag_id);
+      mpc_ast_add_child(r, as[i]->children[0]);
       mpc_ast_delete_no_children(as[i]);
     } else if (as[i] && as[i]->children_num >= 2) {
       for (j = 0; j < as[i]->children_num; j++) {
@@ -3409,7 +3755,7 @@ static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+  return mpca_state(mpc_apply_to(mpc_apply(p, mpcf_str_ast), mpcf_ast_tag_id, (void*)(size_t)mpc_tag_id("string")));
 }
 
 static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
@@ -3417,7 +3763,7 @@ static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+  return mpca_state(mpc_apply_to(mpc_apply(p, mpcf_str_ast), mpcf_ast_tag_id, (void*)(size_t)mpc_tag_id("char")));
 }
 
 static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
@@ -3435,7 +3781,7 @@ static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
   free(y);
   free(m);
 
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+  return mpca_state(mpc_apply_to(mpc_apply(p, mpcf_str_ast), mpcf_ast_tag_id, (void*)(size_t)mpc_tag_id("regex")));
 }
 
 /* Should this just use `isdigit` instead? */
@@ -3501,7 +3847,7 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   free(x);
 
   if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+    return mpca_state(mpca_root(mpc_apply_to(p, mpcf_ast_add_tag_id, (void*)(size_t)mpc_tag_id(p->name))));
   } else {
     return mpca_state(mpca_root(p));
   }
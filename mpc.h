@@ -280,8 +280,22 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+/*
+** Tags are interned. A tag such as "expr|number|regex" is a list of rule
+** names and every distinct tag has an integer ID, so an AST node carries
+** just that ID. IDs of single names come from mpc_tag_id. The string form
+** of a tag is only built when asked for by mpc_tag_str or mpc_ast_get_tag.
+**
+** mpc_tags_cleanup frees the table. Call it once no parsers or ASTs are
+** left, as they hold IDs from it.
+*/
+
+int mpc_tag_id(const char *tag);
+const char *mpc_tag_str(int id);
+void mpc_tags_cleanup(void);
+
 typedef struct mpc_ast_t {
-  char *tag;
+  int tag_id;
   char *contents;
   mpc_state_t state;
   int children_num;
@@ -297,6 +311,9 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
+int mpc_ast_has_tag(mpc_ast_t *a, int id);
+const char *mpc_ast_get_tag(mpc_ast_t *a);
+
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
@@ -372,6 +389,22 @@ void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
+/*
+** Memory Statistics
+**
+** Bytes held by parser inputs, by values allocated while parsing and by
+** the tag table. Results stop being counted once they are handed back to
+** the caller.
+*/
+
+typedef struct {
+  size_t live;
+  size_t peak;
+  size_t total;
+} mpc_mem_stats_t;
+
+void mpc_mem_stats(mpc_mem_stats_t *s);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*),
   mpc_dtor_t destructor,
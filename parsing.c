@@ -1,5 +1,31 @@
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(LVAL_NO_JIT)
+#define LVAL_JIT
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(LSCAN_SCALAR)
+#define LSCAN_X86
+#include <immintrin.h>
+#endif
 
 #include "mpc.h"
 
@@ -33,123 +59,880 @@ struct lval;
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lbind lbind;
 enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUNC, LVAL_SEXPR, LVAL_QEXPR };
 
 lval *lenv_get(lenv *env, lval *a);
 
 lval *lval_copy(lval *a);
+lval *lval_unshare(lval *v);
+struct lcells;
+void lcells_release(struct lcells *c);
+struct lcode;
+void lcode_free(struct lcode *code);
 lval *lval_err(char *m);
+void lenv_put(lenv *env, lval *k, lval *v);
 void lenv_del(lenv *e);
-lval *builtin_op(lenv *env, lval *a, char *op);
 lval *lval_eval(lenv *env, lval *v);
 lval *lval_take(lval *v, int i);
 lval *lval_pop(lval *v, int i);
 void lval_del(lval *v);
 void lval_print(lval *v);
 typedef lval *(*lbuiltin)(lenv *, lval *);
+typedef lval *(*lwindow)(lenv *, lval **, int);
+lwindow lbuiltin_window(lbuiltin func);
+int lbuiltin_flags(lbuiltin func);
+
+/* What is known about each builtin, see lbuiltin_flags */
+enum {
+    LFN_PURE = 1,   // Same result for the same arguments, and no side effects
+    LFN_BINDS = 2,  // May change what symbols are bound to
+};
+lbuiltin lenv_get_builtin(lenv *env, lval *a);
 
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
+/*
+ * Each type only uses its own member of the union, which keeps a node at
+ * 24 bytes. Fixnums never reach this struct at all, see lval_fixnum.
+ */
 struct lval {
-    int type;
-    long num;
+    unsigned char type;
+    unsigned char mark;   // Set by the collector while marking (LVAL_GC)
+    unsigned char arena;  // Allocated from the evaluation arena (LVAL_ARENA)
+    int refs;             // Number of holders sharing this value, see lval_retain
 
-    // Error and Symbol have string data
-    char *error;
-    char *sym;
-    lbuiltin func;
+    union {
+        long num;     // Numbers too big to be a fixnum
+        char *error;  // Error has string data
 
-    // Count of pointers and a list of pointers to lval
-    int count;
-    lval **cell;  // This is the pointer to the cell that holds the
-                  // pointers i.e it points to the list of pointers that
-                  // are pointing to the lval struct
+        // Symbol name is in the intern table, see lsym_name
+        struct {
+            int symid;
+            unsigned version;  // Version of 'bind' when it was found
+            lbind *bind;       // Binding found for it last time, see lenv_get
+        };
+
+        // Builtins that can read borrowed arguments in place also have
+        // a window entry point, see lbuiltin_window
+        struct {
+            lbuiltin func;
+            lwindow win;
+        };
+
+        // Count of pointers and a list of pointers to lval
+        struct {
+            lval **cell;  // This is the pointer to the cell that holds the
+                          // pointers i.e it points to the list of pointers
+                          // that are pointing to the lval struct
+            int count;
+            int start;  // Slots before 'cell' in its buffer, see lcells
+        };
+    };
 };
 
+/* Keep the layout from growing back, this fails to compile if it does */
+typedef char lval_size_check[sizeof(lval) <= 24 ? 1 : -1];
+
+/*
+ * Every byte the interpreter takes from malloc is counted against one of
+ * these categories, so live and peak usage can be reported while running.
+ * Memory inside the slabs and the arena is counted once, when the slab or
+ * chunk itself is allocated. See the mem-stats builtin and ':mem'.
+ */
+enum {
+    LMEM_LVAL,    // Slabs, or single cells with LVAL_USE_MALLOC
+    LMEM_CELLS,   // List cell buffers
+    LMEM_ERROR,   // Error message strings
+    LMEM_SYMBOL,  // Intern table and symbol names
+    LMEM_ENV,     // Environments
+    LMEM_ARENA,   // Arena chunks (LVAL_ARENA)
+    LMEM_GC,      // Collector root stack (LVAL_GC)
+    LMEM_AST,     // Parse tree of the form being read, or the reader stack
+    LMEM_CODE,    // Bytecode, native code and the VM stack (--vm, --jit)
+    LMEM_STACK,   // Frames of the evaluation stack
+    LMEM_COUNT
+};
+
+static const char *lmem_names[LMEM_COUNT] = {
+    "lval", "cells", "errors", "symbols", "env", "arena", "gc", "ast", "code",
+    "stack"};
+
+typedef struct lmem {
+    size_t live[LMEM_COUNT];
+    size_t peak[LMEM_COUNT];
+    size_t total;
+    size_t total_peak;
+} lmem;
+
+static lmem lval_mem;
+
+static inline void lmem_add(int kind, size_t n) {
+    lmem *m = &lval_mem;
+    m->live[kind] += n;
+    if (m->live[kind] > m->peak[kind]) {
+        m->peak[kind] = m->live[kind];
+    }
+    m->total += n;
+    if (m->total > m->total_peak) {
+        m->total_peak = m->total;
+    }
+}
+
+static inline void lmem_sub(int kind, size_t n) {
+    lval_mem.live[kind] -= n;
+    lval_mem.total -= n;
+}
+
+/*
+ * lval cells are carved out of fixed size slabs and recycled through a free
+ * list instead of going through malloc/free for every node. Build with
+ * -DLVAL_USE_MALLOC to fall back to plain malloc.
+ */
+#define LVAL_SLAB_CELLS 512
+
+/* Type of a slot sitting on the free list */
+#define LSLOT_FREE 0xff
+
+typedef union lslot {
+    lval val;
+    struct {
+        unsigned char type;
+        union lslot *next;
+    } free;
+} lslot;
+
+typedef struct lslab {
+    struct lslab *next;
+    lslot slots[LVAL_SLAB_CELLS];
+} lslab;
+
+typedef struct lpool {
+    lslab *slabs;
+    int fresh;    // Untouched slots left at the end of the newest slab
+    lslot *free;  // Cells handed back by lval_free
+
+    long live;
+    long peak;
+    long recycled;  // Allocations served from the free list
+    long slab_count;
+} lpool;
+
+/* One pool per interpreter */
+static lpool lval_pool;
+
+/*
+ * With -DLVAL_ARENA everything allocated while one top-level form is read,
+ * evaluated and printed comes from a bump allocator, and is released by a
+ * single larena_reset once the form is done. Values that escape into the
+ * environment are copied out first by lval_promote.
+ */
+#ifdef LVAL_ARENA
+#ifdef LVAL_GC
+#error "LVAL_ARENA and LVAL_GC are alternative memory schemes"
+#endif
+
+#define LARENA_CHUNK (64 * 1024)
+
+typedef struct lchunk {
+    struct lchunk *next;
+    size_t size;
+    long data[];  // long keeps allocations word aligned
+} lchunk;
+
+typedef struct larena {
+    int active;
+    lchunk *chunks;   // Standard sized chunks, reused after a reset
+    lchunk *current;  // Chunk being bumped
+    char *ptr;
+    char *end;
+    lchunk *large;  // Oversized requests, freed on reset
+
+    size_t used;
+    size_t peak;
+    long resets;
+} larena;
+
+static larena lval_arena;
+
+void *larena_alloc(size_t n) {
+    larena *a = &lval_arena;
+    n = (n + 15) & ~(size_t)15;
+
+    if (n > LARENA_CHUNK / 4) {
+        lchunk *c = malloc(sizeof(lchunk) + n);
+        lmem_add(LMEM_ARENA, sizeof(lchunk) + n);
+        c->size = n;
+        c->next = a->large;
+        a->large = c;
+        a->used += n;
+        return c->data;
+    }
+    if (a->ptr == NULL || a->ptr + n > a->end) {
+        lchunk *c = a->current ? a->current->next : a->chunks;
+        if (c == NULL) {
+            c = malloc(sizeof(lchunk) + LARENA_CHUNK);
+            lmem_add(LMEM_ARENA, sizeof(lchunk) + LARENA_CHUNK);
+            c->size = LARENA_CHUNK;
+            c->next = NULL;
+            if (a->current) {
+                a->current->next = c;
+            } else {
+                a->chunks = c;
+            }
+        }
+        a->current = c;
+        a->ptr = (char *)c->data;
+        a->end = a->ptr + c->size;
+    }
+    void *p = a->ptr;
+    a->ptr += n;
+    a->used += n;
+    return p;
+}
+
+/* Starts allocating temporaries from the arena */
+void larena_begin(void) { lval_arena.active = 1; }
+
+/* Releases everything allocated since larena_begin */
+void larena_reset(void) {
+    larena *a = &lval_arena;
+    while (a->large) {
+        lchunk *next = a->large->next;
+        lmem_sub(LMEM_ARENA, sizeof(lchunk) + a->large->size);
+        free(a->large);
+        a->large = next;
+    }
+    if (a->used > a->peak) {
+        a->peak = a->used;
+    }
+    a->used = 0;
+    a->current = NULL;
+    a->ptr = NULL;
+    a->end = NULL;
+    a->active = 0;
+    a->resets++;
+}
+
+void larena_destroy(void) {
+    larena_reset();
+    while (lval_arena.chunks) {
+        lchunk *next = lval_arena.chunks->next;
+        lmem_sub(LMEM_ARENA, sizeof(lchunk) + lval_arena.chunks->size);
+        free(lval_arena.chunks);
+        lval_arena.chunks = next;
+    }
+}
+#else
+static inline void larena_begin(void) {}
+static inline void larena_reset(void) {}
+static inline void larena_destroy(void) {}
+#endif
+
+/* Allocations owned by an lval, such as cell buffers and error strings,
+   come from the same place as the lval itself. 'kind' is the LMEM_
+   category heap allocations are counted under */
+void *lval_mem_alloc(lval *owner, int kind, size_t n) {
+#ifdef LVAL_ARENA
+    if (owner->arena) {
+        return larena_alloc(n);
+    }
+#endif
+    lmem_add(kind, n);
+    return malloc(n);
+}
+
+void *lval_mem_realloc(lval *owner, int kind, void *p, size_t old, size_t n) {
+#ifdef LVAL_ARENA
+    if (owner->arena) {
+        void *x = larena_alloc(n);
+        if (p) {
+            memcpy(x, p, old < n ? old : n);
+        }
+        return x;
+    }
+#endif
+    lmem_sub(kind, old);
+    lmem_add(kind, n);
+    return realloc(p, n);
+}
+
+void lval_mem_free(lval *owner, int kind, void *p, size_t n) {
+#ifdef LVAL_ARENA
+    if (owner->arena) {
+        return;
+    }
+#endif
+    lmem_sub(kind, n);
+    free(p);
+}
+
+lval *lval_alloc(void) {
+    lpool *p = &lval_pool;
+    lval *v;
+#ifdef LVAL_ARENA
+    if (lval_arena.active) {
+        v = larena_alloc(sizeof(lval));
+        v->refs = 1;
+        v->mark = 0;
+        v->arena = 1;
+        return v;
+    }
+#endif
+#ifdef LVAL_USE_MALLOC
+    v = malloc(sizeof(lval));
+    lmem_add(LMEM_LVAL, sizeof(lval));
+#else
+    if (p->free) {
+        v = &p->free->val;
+        p->free = p->free->free.next;
+        p->recycled++;
+    } else {
+        if (p->fresh == 0) {
+            lslab *s = malloc(sizeof(lslab));
+            lmem_add(LMEM_LVAL, sizeof(lslab));
+            s->next = p->slabs;
+            p->slabs = s;
+            p->fresh = LVAL_SLAB_CELLS;
+            p->slab_count++;
+        }
+        v = &p->slabs->slots[LVAL_SLAB_CELLS - p->fresh].val;
+        p->fresh--;
+    }
+#endif
+    p->live++;
+    if (p->live > p->peak) {
+        p->peak = p->live;
+    }
+    v->refs = 1;
+    v->mark = 0;
+    v->arena = 0;
+    return v;
+}
+
+void lval_free(lval *v) {
+    lpool *p = &lval_pool;
+    if (v->arena) {
+        return;
+    }
+    p->live--;
+#ifdef LVAL_USE_MALLOC
+    lmem_sub(LMEM_LVAL, sizeof(lval));
+    free(v);
+#else
+    lslot *s = (lslot *)v;
+    s->free.type = LSLOT_FREE;
+    s->free.next = p->free;
+    p->free = s;
+#endif
+}
+
+#ifdef LVAL_GC
+#ifdef LVAL_USE_MALLOC
+#error "LVAL_GC sweeps the slab pool and cannot be used with LVAL_USE_MALLOC"
+#endif
+void lgc_collect(lenv *env);
+void lgc_destroy(void);
+void lgc_print_stats(void);
+#endif
+
+/* Releases every slab. Only valid once no lval is reachable any more */
+void lval_pool_destroy(void) {
+    lpool *p = &lval_pool;
+#ifdef LVAL_GC
+    /* Sweep with no roots so payloads are released as well */
+    lgc_collect(NULL);
+    lgc_destroy();
+#endif
+    while (p->slabs) {
+        lslab *next = p->slabs->next;
+        lmem_sub(LMEM_LVAL, sizeof(lslab));
+        free(p->slabs);
+        p->slabs = next;
+    }
+    p->free = NULL;
+    p->fresh = 0;
+}
+
+void lval_pool_print_stats(void) {
+    lpool *p = &lval_pool;
+    printf("lval cells: live %li, peak %li, recycled %li, slabs %li\n",
+           p->live, p->peak, p->recycled, p->slab_count);
+#ifdef LVAL_GC
+    lgc_print_stats();
+#endif
+#ifdef LVAL_ARENA
+    printf("arena: %li resets, peak %zu bytes per form\n", lval_arena.resets,
+           lval_arena.peak);
+#endif
+}
+
+/* Bytes mpc allocated for a parse tree, which it hands over untracked */
+size_t lmem_ast_size(mpc_ast_t *t) {
+    size_t n = sizeof(mpc_ast_t) + strlen(t->contents) + 1 +
+               sizeof(mpc_ast_t *) * t->children_num;
+    for (int i = 0; i < t->children_num; i++) {
+        n += lmem_ast_size(t->children[i]);
+    }
+    return n;
+}
+
+void lmem_print(void) {
+    lmem *m = &lval_mem;
+    mpc_mem_stats_t parser;
+    mpc_mem_stats(&parser);
+
+    printf("%-10s %12s %12s\n", "category", "live", "peak");
+    for (int i = 0; i < LMEM_COUNT; i++) {
+        printf("%-10s %12zu %12zu\n", lmem_names[i], m->live[i], m->peak[i]);
+    }
+    printf("%-10s %12zu %12zu\n", "total", m->total, m->total_peak);
+    printf("%-10s %12zu %12zu\n", "parser", parser.live, parser.peak);
+    lval_pool_print_stats();
+}
+
+/*
+ * With -DLVAL_GC lval_del only drops the holder count and storage is
+ * reclaimed by a mark-sweep collector over the slab pool instead. The
+ * collector only runs at safe points in lval_eval, where everything live
+ * is either bound in the environment, on the root stack or in a frame of
+ * the evaluation stack.
+ */
+#ifdef LVAL_GC
+int lgc_enter(lenv *env, lval *v);
+void lgc_root(lval *v);
+void lgc_leave(int depth);
+void lgc_safe_point(lenv *env);
+#else
+static inline int lgc_enter(lenv *env, lval *v) { return 0; }
+static inline void lgc_root(lval *v) {}
+static inline void lgc_leave(int depth) {}
+static inline void lgc_safe_point(lenv *env) {}
+#endif
+
+/*
+ * Numbers that fit in a pointer word minus one bit are never allocated: the
+ * value is stored in the lval pointer itself with the low bit set. Cells are
+ * always word aligned so a real lval pointer never has that bit set. Use
+ * lval_type and lval_to_num rather than touching ->type and ->num directly
+ * whenever the value might be a fixnum.
+ */
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+
+static inline int lval_is_fixnum(lval *v) { return (uintptr_t)v & 1; }
+
+static inline lval *lval_fixnum(long n) {
+    return (lval *)(((uintptr_t)n << 1) | 1);
+}
+
+static inline int lval_type(lval *v) {
+    return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_to_num(lval *v) {
+    /* Arithmetic shift restores the sign */
+    return lval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+/*
+ * Values are immutable once they are shared. lval_retain adds a holder and
+ * lval_del drops one, freeing the value with its last holder. Anything that
+ * is about to mutate a value it owns must go through lval_unshare first.
+ */
+static inline lval *lval_retain(lval *v) {
+    if (!lval_is_fixnum(v)) {
+        v->refs++;
+    }
+    return v;
+}
+
+/*
+ * List cells live in a buffer that records its own capacity, keeping that
+ * out of every lval. A list is a view of 'count' slots starting 'start'
+ * slots into the buffer, so popping the first element just moves 'cell'
+ * forward.
+ *
+ * Buffers are copy on write: lval_copy makes a new view of the same
+ * buffer, and views can shrink or grow at the end without copying. The
+ * buffer holds one reference to every slot in [lo, hi), which covers all
+ * of its views. Anything else goes through lval_own first.
+ *
+ * A buffer also keeps the bytecode last compiled from one of its views,
+ * which lval_own throws away before the slots can change.
+ */
+typedef struct lcells {
+    int refs;  // Lists viewing this buffer
+    int capacity;
+    int lo;
+    int hi;
+    int arena;  // Allocated from the evaluation arena (LVAL_ARENA)
+    struct lcode *code;
+    lval *slots[];
+} lcells;
+
+static inline lcells *lval_cells(lval *v) {
+    if (v->cell == NULL) {
+        return NULL;
+    }
+    return (lcells *)((char *)(v->cell - v->start) - offsetof(lcells, slots));
+}
+
 lval *lval_err(char *m) {
-    lval *a = malloc(sizeof(lval));
+    lval *a = lval_alloc();
     a->type = LVAL_ERR;
-    a->error = malloc(strlen(m) + 1);
+    a->error = lval_mem_alloc(a, LMEM_ERROR, strlen(m) + 1);
     strcpy(a->error, m);
     return a;
 }
 
 lval *lval_num(long num) {
-    lval *a = malloc(sizeof(lval));
+    if (num >= LVAL_FIXNUM_MIN && num <= LVAL_FIXNUM_MAX) {
+        return lval_fixnum(num);
+    }
+    lval *a = lval_alloc();
     a->type = LVAL_NUM;
     a->num = num;
     return a;
 }
 
-lval *lval_sym(char *s) {
-    lval *a = malloc(sizeof(lval));
+/*
+ * Every symbol name is stored once in a global intern table and identified
+ * by a small integer. Symbol lvals carry the id, so comparing two symbols
+ * never looks at the characters.
+ */
+typedef struct lsymtab {
+    /* Indexed by symbol id */
+    char **names;
+    unsigned *hashes;
+    int count;
+    int capacity;
+
+    /* Open addressing table of id + 1, zero marks an empty slot */
+    int *slots;
+    int slot_count;  // Always a power of two
+} lsymtab;
+
+static lsymtab lval_symbols;
+
+static unsigned lsym_hash(const char *s, size_t n) {
+    /* FNV-1a */
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void lsym_rehash(lsymtab *t) {
+    lmem_sub(LMEM_SYMBOL, sizeof(int) * t->slot_count);
+    free(t->slots);
+    t->slot_count = t->slot_count ? t->slot_count * 2 : 256;
+    t->slots = calloc(t->slot_count, sizeof(int));
+    lmem_add(LMEM_SYMBOL, sizeof(int) * t->slot_count);
+    for (int id = 0; id < t->count; id++) {
+        unsigned i = t->hashes[id] & (t->slot_count - 1);
+        while (t->slots[i]) {
+            i = (i + 1) & (t->slot_count - 1);
+        }
+        t->slots[i] = id + 1;
+    }
+}
+
+/* Returns the id of the 'n' characters at 's', adding them to the table
+   the first time they are seen. Only a new name is copied, so 's' can be
+   a slice of a larger buffer */
+int lsym_intern_n(const char *s, size_t n) {
+    lsymtab *t = &lval_symbols;
+    unsigned h = lsym_hash(s, n);
+
+    if (t->slot_count) {
+        unsigned i = h & (t->slot_count - 1);
+        while (t->slots[i]) {
+            int id = t->slots[i] - 1;
+            if (t->hashes[id] == h && strncmp(t->names[id], s, n) == 0 &&
+                t->names[id][n] == '\0') {
+                return id;
+            }
+            i = (i + 1) & (t->slot_count - 1);
+        }
+    }
+
+    /* Keep the table at most half full */
+    if ((t->count + 1) * 2 > t->slot_count) {
+        lsym_rehash(t);
+    }
+    if (t->count == t->capacity) {
+        lmem_sub(LMEM_SYMBOL, (sizeof(char *) + sizeof(unsigned)) * t->capacity);
+        t->capacity = t->capacity ? t->capacity * 2 : 64;
+        t->names = realloc(t->names, sizeof(char *) * t->capacity);
+        t->hashes = realloc(t->hashes, sizeof(unsigned) * t->capacity);
+        lmem_add(LMEM_SYMBOL, (sizeof(char *) + sizeof(unsigned)) * t->capacity);
+    }
+    int id = t->count++;
+    t->names[id] = malloc(n + 1);
+    lmem_add(LMEM_SYMBOL, n + 1);
+    memcpy(t->names[id], s, n);
+    t->names[id][n] = '\0';
+    t->hashes[id] = h;
+
+    unsigned i = h & (t->slot_count - 1);
+    while (t->slots[i]) {
+        i = (i + 1) & (t->slot_count - 1);
+    }
+    t->slots[i] = id + 1;
+    return id;
+}
+
+const char *lsym_name(int id) { return lval_symbols.names[id]; }
+
+unsigned lsym_hash_of(int id) { return lval_symbols.hashes[id]; }
+
+void lsym_destroy(void) {
+    lsymtab *t = &lval_symbols;
+    for (int id = 0; id < t->count; id++) {
+        lmem_sub(LMEM_SYMBOL, strlen(t->names[id]) + 1);
+        free(t->names[id]);
+    }
+    lmem_sub(LMEM_SYMBOL, (sizeof(char *) + sizeof(unsigned)) * t->capacity +
+                              sizeof(int) * t->slot_count);
+    free(t->names);
+    free(t->hashes);
+    free(t->slots);
+    memset(t, 0, sizeof(lsymtab));
+}
+
+/* Symbol named by the 'n' characters at 's' */
+lval *lval_sym_n(const char *s, size_t n) {
+    lval *a = lval_alloc();
     a->type = LVAL_SYM;
-    a->sym = malloc(strlen(s) + 1);
-    strcpy(a->sym, s);
+    a->symid = lsym_intern_n(s, n);
+    a->version = 0;
+    a->bind = NULL;
     return a;
 }
 
+lval *lval_sym(char *s) { return lval_sym_n(s, strlen(s)); }
+
 lval *lval_func(lbuiltin func) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_FUNC;
     v->func = func;
+    v->win = lbuiltin_window(func);
     return v;
 }
 
 lval *lval_sexpr(void) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_SEXPR;
     v->count = 0;
     v->cell = NULL;
+    v->start = 0;
     return v;
 }
 
 lval *lval_qexpr(void) {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_QEXPR;
     v->count = 0;
     v->cell = NULL;
+    v->start = 0;
     return v;
 }
 
 void lval_del(lval *v) {
+    if (lval_is_fixnum(v)) {
+        return;
+    }
+    if (--v->refs > 0) {
+        return;
+    }
+#ifdef LVAL_GC
+    return;
+#endif
     switch (v->type) {
         case LVAL_NUM:
             break;
         case LVAL_FUNC:
             break;
         case LVAL_ERR:
-            free(v->error);
+            lval_mem_free(v, LMEM_ERROR, v->error, strlen(v->error) + 1);
             break;
         case LVAL_SYM:
-            free(v->sym);
             break;
 
         case LVAL_QEXPR:
         case LVAL_SEXPR:
-            for (int i = 0; i < v->count; i++) {
-                lval_del(v->cell[i]);
+            if (v->cell) {
+                lcells_release(lval_cells(v));
             }
-            free(v->cell);
             break;
     }
-    free(v);
+    lval_free(v);
+}
+
+static size_t lcells_size(int capacity) {
+    return sizeof(lcells) + sizeof(lval *) * capacity;
+}
+
+/* Drops a view of 'c', releasing the slots with the last one */
+void lcells_release(lcells *c) {
+    if (--c->refs > 0) {
+        return;
+    }
+    for (int i = c->lo; i < c->hi; i++) {
+        lval_del(c->slots[i]);
+    }
+#ifdef LVAL_ARENA
+    if (c->arena) {
+        return;
+    }
+#endif
+    lcode_free(c->code);
+    lmem_sub(LMEM_CELLS, lcells_size(c->capacity));
+    free(c);
+}
+
+/* Moves a private buffer to one of 'capacity' slots owned like 'owner' */
+lcells *lcells_resize(lval *owner, lcells *c, int capacity) {
+#ifdef LVAL_ARENA
+    if (c && c->arena != owner->arena) {
+        lcells *x = lval_mem_alloc(owner, LMEM_CELLS, lcells_size(capacity));
+        memcpy(x, c, lcells_size(c->capacity));
+        if (!c->arena) {
+            lmem_sub(LMEM_CELLS, lcells_size(c->capacity));
+            free(c);
+        }
+        c = x;
+    } else
+#endif
+    {
+        size_t old = c ? lcells_size(c->capacity) : 0;
+        lcells *x =
+            lval_mem_realloc(owner, LMEM_CELLS, c, old, lcells_size(capacity));
+        if (c == NULL) {
+            x->refs = 1;
+            x->lo = 0;
+            x->hi = 0;
+            x->code = NULL;
+        }
+        c = x;
+    }
+    c->capacity = capacity;
+    c->arena = owner->arena;
+    return c;
+}
+
+/* Gives 'v' a buffer of its own holding just its cells */
+void lval_cells_copy(lval *v, int capacity) {
+    lcells *old = lval_cells(v);
+    lcells *c = lcells_resize(v, NULL, capacity);
+    for (int i = 0; i < v->count; i++) {
+        c->slots[i] = lval_retain(v->cell[i]);
+    }
+    c->hi = v->count;
+    lcells_release(old);
+    v->cell = c->slots;
+    v->start = 0;
+}
+
+/*
+ * Makes the buffer of 'v' private to it and drops any slots outside the
+ * view, so the cells can be rearranged or overwritten in place. Callers
+ * must already own 'v' itself, see lval_unshare.
+ */
+void lval_own(lval *v) {
+    lcells *c = lval_cells(v);
+    if (c == NULL) {
+        return;
+    }
+    if (v->count == 0) {
+        lcells_release(c);
+        v->cell = NULL;
+        v->start = 0;
+        return;
+    }
+    if (c->refs > 1) {
+        lval_cells_copy(v, v->count);
+        return;
+    }
+    lcode_free(c->code);
+    c->code = NULL;
+    for (int i = c->lo; i < v->start; i++) {
+        lval_del(c->slots[i]);
+    }
+    for (int i = v->start + v->count; i < c->hi; i++) {
+        lval_del(c->slots[i]);
+    }
+    c->lo = v->start;
+    c->hi = v->start + v->count;
+}
+
+/* Whether a view ending at 'c->hi' may append in place while 'c' is shared.
+   The new slots are beyond every other view, so they cannot see them */
+static inline int lcells_can_extend(lcells *c) {
+#ifdef LVAL_ARENA
+    /* A heap buffer must not pick up arena cells that no view of it shows,
+       lval_promote would never find them */
+    if (lval_arena.active && !c->arena) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+/* Makes room to append until 'v' holds 'n' cells */
+void lval_reserve(lval *v, int n) {
+    lcells *c = lval_cells(v);
+    if (c && v->start + n <= c->capacity && v->start + v->count == c->hi &&
+        (c->refs == 1 || lcells_can_extend(c))) {
+        return;
+    }
+    if (c && c->refs > 1 && v->count > 0) {
+        lval_cells_copy(v, n);
+        return;
+    }
+    lval_own(v);
+    c = lval_cells(v);
+    int capacity = c ? c->capacity : 0;
+    if (v->start + n <= capacity) {
+        return;
+    }
+
+    /* Reuse the space left by popping from the front if it is at least
+       half the buffer, otherwise grow geometrically */
+    if (v->start > 0 && n <= capacity && v->start >= capacity / 2) {
+        memmove(c->slots, v->cell, sizeof(lval *) * v->count);
+        v->cell = c->slots;
+        v->start = 0;
+        c->lo = 0;
+        c->hi = v->count;
+        return;
+    }
+    capacity = capacity ? capacity * 2 : 4;
+    if (capacity < v->start + n) {
+        capacity = v->start + n;
+    }
+    c = lcells_resize(v, c, capacity);
+    v->cell = c->slots + v->start;
 }
 
 lval *lval_add(lval *v, lval *x) {
+    lval_reserve(v, v->count + 1);
+    v->cell[v->count] = x;
     v->count++;
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-    v->cell[v->count - 1] = x;
+    lval_cells(v)->hi = v->start + v->count;
     return v;
 }
 
 lval *lval_join(lval *x, lval *y) {
     /* For each cell in 'y' add it to 'x' */
+    x = lval_unshare(x);
+    lval_reserve(x, x->count + y->count);
     for (int i = 0; i < y->count; i++) {
-        x = lval_add(x, y->cell[i]);
+        x = lval_add(x, lval_retain(y->cell[i]));
     }
-    free(y->cell);
-    free(y);
+    lval_del(y);
 
     return x;
 }
@@ -160,14 +943,60 @@ lval *lval_pop(lval *v, int i) {
     // pointer without referencing the address of the pointer. The '&' operator
     // is needed to pass the address of the pointer to the memmove function.
 
+    lcells *c = lval_cells(v);
+
+    /* Other views still need the cell, so hand out another reference to
+       it and narrow this one */
+    if (c->refs > 1 && (i == 0 || i == v->count - 1)) {
+        lval *x = lval_retain(v->cell[i]);
+        if (i == 0) {
+            v->cell++;
+            v->start++;
+        }
+        v->count--;
+        return x;
+    }
+
+    lval_own(v);
+    c = lval_cells(v);
     lval *x = v->cell[i];
 
-    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+    /* Close the gap from whichever side has fewer cells to move. The
+       buffer is never shrunk, it is only freed with the list */
+    if (i < v->count / 2) {
+        memmove(&v->cell[1], &v->cell[0], sizeof(lval *) * i);
+        v->cell++;
+        v->start++;
+        c->lo++;
+    } else {
+        memmove(&v->cell[i], &v->cell[i + 1],
+                sizeof(lval *) * (v->count - i - 1));
+        c->hi--;
+    }
     v->count--;
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
+
+    if (v->count == 0) {
+        v->cell = c->slots;
+        v->start = 0;
+        c->lo = 0;
+        c->hi = 0;
+    }
     return x;
 }
 
+/* Deletes every cell from index 'n' onwards */
+void lval_truncate(lval *v, int n) {
+    if (n < v->count && lval_cells(v)->refs == 1) {
+        lval_own(v);
+        for (int i = n; i < v->count; i++) {
+            lval_del(v->cell[i]);
+        }
+        lval_cells(v)->hi = v->start + n;
+    }
+    /* A shared buffer keeps the cells for its other views */
+    v->count = n;
+}
+
 lval *lval_take(lval *v, int i) {
     lval *x = lval_pop(v, i);
     lval_del(v);
@@ -188,18 +1017,18 @@ void lval_expr_print(lval *v, char open, char close) {
 }
 
 void lval_print(lval *v) {
-    switch (v->type) {
+    switch (lval_type(v)) {
         /* In the case the type is a number print it */
         /* Then 'break' out of the switch. */
         case LVAL_NUM:
-            printf("%li", v->num);
+            printf("%li", lval_to_num(v));
             break;
 
         case LVAL_ERR:
             printf("Error: %s", v->error);
             break;
         case LVAL_SYM:
-            printf("%s", v->sym);
+            printf("%s", lsym_name(v->symid));
             break;
         case LVAL_SEXPR:
             lval_expr_print(v, '(', ')');
@@ -214,37 +1043,93 @@ void lval_print(lval *v) {
 }
 
 lval *lval_copy(lval *v) {
-    lval *x = malloc(sizeof(lval));
+    if (lval_is_fixnum(v)) {
+        return v;
+    }
+    lval *x = lval_alloc();
     x->type = v->type;
 
     switch (v->type) {
         case LVAL_FUNC:
             x->func = v->func;
+            x->win = v->win;
             break;
         case LVAL_NUM:
             x->num = v->num;
             break;
 
         case LVAL_ERR:
-            x->error = malloc(sizeof(v->error) + 1);
+            x->error = lval_mem_alloc(x, LMEM_ERROR, strlen(v->error) + 1);
             strcpy(x->error, v->error);
             break;
         case LVAL_SYM:
-            x->sym = malloc(sizeof(x->sym) + 1);
-            strcpy(x->sym, v->sym);
+            x->symid = v->symid;
+            x->version = v->version;
+            x->bind = v->bind;
             break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
+            /* Share the buffer, it gets copied when either list mutates it */
             x->count = v->count;
-            x->cell = malloc(sizeof(lval *) * x->count);
-            for (int i = 0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
+            x->cell = v->cell;
+            x->start = v->start;
+            if (x->cell) {
+                lval_cells(x)->refs++;
             }
             break;
     }
     return x;
 }
 
+#ifdef LVAL_ARENA
+lval *lval_promote_cells(lval *v) {
+    if (lval_is_fixnum(v)) {
+        return v;
+    }
+    if (v->arena) {
+        lval *x = lval_copy(v);
+        lval_del(v);
+        v = x;
+    }
+    if ((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || !v->cell) {
+        return v;
+    }
+    if (lval_cells(v)->arena) {
+        lval_cells_copy(v, v->count);
+    }
+    /* Heap buffers can hold arena cells if they were extended in place.
+       Each replacement is equal to what it replaces, so this is safe to do
+       even if other lists share the buffer */
+    lcells *c = lval_cells(v);
+    for (int i = c->lo; i < c->hi; i++) {
+        c->slots[i] = lval_promote_cells(c->slots[i]);
+    }
+    return v;
+}
+
+/* Takes ownership of 'v' and returns an equal value with no part of it in
+   the arena, so it survives larena_reset */
+lval *lval_promote(lval *v) {
+    int active = lval_arena.active;
+    lval_arena.active = 0;
+    v = lval_promote_cells(v);
+    lval_arena.active = active;
+    return v;
+}
+#else
+static inline lval *lval_promote(lval *v) { return v; }
+#endif
+
+/* Returns a value the caller may mutate, copying 'v' if it is shared */
+lval *lval_unshare(lval *v) {
+    if (lval_is_fixnum(v) || v->refs == 1) {
+        return v;
+    }
+    lval *x = lval_copy(v);
+    lval_del(v);
+    return x;
+}
+
 /* Print an "lval" followed by a newline */
 void lval_println(lval *v)
 
@@ -259,22 +1144,36 @@ lval *lval_read_num(mpc_ast_t *t) {
     return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
 }
 
+/* Tag IDs of the grammar's rules, so lval_read compares integers */
+static struct {
+    int number, symbol, sexpr, qexpr, regex, root;
+} lval_tags;
+
+void lval_tags_init(void) {
+    lval_tags.number = mpc_tag_id("number");
+    lval_tags.symbol = mpc_tag_id("symbol");
+    lval_tags.sexpr = mpc_tag_id("sexpr");
+    lval_tags.qexpr = mpc_tag_id("qexpr");
+    lval_tags.regex = mpc_tag_id("regex");
+    lval_tags.root = mpc_tag_id(">");
+}
+
 lval *lval_read(mpc_ast_t *t) {
-    if (strstr(t->tag, "number")) {
+    if (mpc_ast_has_tag(t, lval_tags.number)) {
         return lval_read_num(t);
     }
-    if (strstr(t->tag, "symbol")) {
+    if (mpc_ast_has_tag(t, lval_tags.symbol)) {
         return lval_sym(t->contents);
     }
 
     lval *x = NULL;
-    if (strcmp(t->tag, ">") == 0) {
+    if (t->tag_id == lval_tags.root) {
         x = lval_sexpr();
     }
-    if (strstr(t->tag, "sexpr")) {
+    if (mpc_ast_has_tag(t, lval_tags.sexpr)) {
         x = lval_sexpr();
     }
-    if (strstr(t->tag, "qexpr")) {
+    if (mpc_ast_has_tag(t, lval_tags.qexpr)) {
         x = lval_qexpr();
     }
 
@@ -291,7 +1190,7 @@ lval *lval_read(mpc_ast_t *t) {
         if (strcmp(t->children[i]->contents, "}") == 0) {
             continue;
         }
-        if (strcmp(t->children[i]->tag, "regex") == 0) {
+        if (t->children[i]->tag_id == lval_tags.regex) {
             continue;
         }
         x = lval_add(x, lval_read(t->children[i]));
@@ -300,13 +1199,360 @@ lval *lval_read(mpc_ast_t *t) {
     return x;
 }
 
-lval *lval_sexpr_eval(lenv *env, lval *v) {
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(env, v->cell[i]);
+/*
+ * lval_read_n reads a line of source straight into lvals, without
+ * building an mpc_ast_t to walk and free. It accepts exactly the Lispy
+ * grammar, including mpc's habit of trying a number before a symbol at
+ * each position, so "1a" reads as 1 followed by a. Open lists are kept on
+ * a stack of their own rather than on the C stack.
+ *
+ * Lists nest at most LREAD_MAX_DEPTH deep, as folding, resolving,
+ * printing and freeing a form still recurse once per level. mpc's own
+ * recursion limit turns away lines nested a little over 100 deep, so
+ * anything past this goes to mpc, which reads it or reports its error.
+ *
+ * Input it does not accept gives NULL, and the caller runs mpc over the
+ * same line for the error message and its position. '--mpc-reader' always
+ * uses mpc.
+ */
+#ifndef LREAD_MAX_DEPTH
+#define LREAD_MAX_DEPTH 100
+#endif
+
+typedef struct lreader {
+    int mpc;  // --mpc-reader
+    lval **stack;
+    int count;
+    int capacity;
+} lreader;
+
+static lreader lval_reader;
+
+static inline int lread_space(char c) {
+    return c == ' ' || c == '\f' || c == '\n' || c == '\r' || c == '\t' ||
+           c == '\v';
+}
+
+static inline int lread_digit(char c) { return c >= '0' && c <= '9'; }
+
+/* Characters of /[a-zA-Z0-9_+\-*\/\\=<>!&]+/ */
+static inline int lread_symbol(char c) {
+    switch (c) {
+        case '_': case '+': case '-': case '*': case '/':
+        case '\\': case '=': case '<': case '>': case '!': case '&':
+            return 1;
     }
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           lread_digit(c);
+}
 
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) {
+/*
+ * The reader finds where tokens end from bitmasks rather than testing one
+ * character at a time. A block of 64 bytes is classified at once into
+ * masks of whitespace, symbol characters and digits, and a run of one
+ * class ends at the first clear bit. Consecutive tokens share a block, so
+ * each byte is classified only once.
+ *
+ * On x86-64 the classifier uses AVX2 or SSE2, picked at run time by
+ * lscan_init. Elsewhere, or with -DLSCAN_SCALAR, a scalar loop does it.
+ */
+enum { LSCAN_SPACE, LSCAN_SYMBOL, LSCAN_DIGIT, LSCAN_COUNT };
+
+/* Bit i of each mask is the class of base[i] */
+typedef struct lblock {
+    const char *base;
+    uint64_t masks[LSCAN_COUNT];
+} lblock;
+
+typedef void (*lclassify)(const char *p, lblock *b);
+
+static void lclassify_scalar(const char *p, lblock *b) {
+    memset(b->masks, 0, sizeof(b->masks));
+    for (int i = 0; i < 64; i++) {
+        b->masks[LSCAN_SPACE] |= (uint64_t)lread_space(p[i]) << i;
+        b->masks[LSCAN_SYMBOL] |= (uint64_t)lread_symbol(p[i]) << i;
+        b->masks[LSCAN_DIGIT] |= (uint64_t)lread_digit(p[i]) << i;
+    }
+}
+
+#ifdef LSCAN_X86
+/* Bytes of 'c' in [lo, hi]. Signed compares are fine, bytes above 127
+   come out negative and fall outside every class */
+static inline __m128i lsse2_range(__m128i c, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1)));
+}
+
+static void lclassify_sse2(const char *p, lblock *b) {
+    static const char punct[] = "_+-*/\\=<>!&";
+    memset(b->masks, 0, sizeof(b->masks));
+    for (int i = 0; i < 64; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        __m128i digit = lsse2_range(c, '0', '9');
+        __m128i symbol = _mm_or_si128(lsse2_range(lower, 'a', 'z'), digit);
+        for (int k = 0; punct[k]; k++) {
+            symbol = _mm_or_si128(symbol,
+                                  _mm_cmpeq_epi8(c, _mm_set1_epi8(punct[k])));
+        }
+        /* ' ' and \t \n \v \f \r */
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                                     lsse2_range(c, '\t', '\r'));
+        uint64_t m = (unsigned)_mm_movemask_epi8(space);
+        b->masks[LSCAN_SPACE] |= m << i;
+        m = (unsigned)_mm_movemask_epi8(symbol);
+        b->masks[LSCAN_SYMBOL] |= m << i;
+        m = (unsigned)_mm_movemask_epi8(digit);
+        b->masks[LSCAN_DIGIT] |= m << i;
+    }
+}
+
+#define LAVX2 __attribute__((target("avx2")))
+
+LAVX2 static inline __m256i lavx2_range(__m256i c, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(lo - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), c));
+}
+
+LAVX2 static void lclassify_avx2(const char *p, lblock *b) {
+    static const char punct[] = "_+-*/\\=<>!&";
+    memset(b->masks, 0, sizeof(b->masks));
+    for (int i = 0; i < 64; i += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+        __m256i digit = lavx2_range(c, '0', '9');
+        __m256i symbol =
+            _mm256_or_si256(lavx2_range(lower, 'a', 'z'), digit);
+        for (int k = 0; punct[k]; k++) {
+            symbol = _mm256_or_si256(
+                symbol, _mm256_cmpeq_epi8(c, _mm256_set1_epi8(punct[k])));
+        }
+        __m256i space =
+            _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                            lavx2_range(c, '\t', '\r'));
+        uint64_t m = (unsigned)_mm256_movemask_epi8(space);
+        b->masks[LSCAN_SPACE] |= m << i;
+        m = (unsigned)_mm256_movemask_epi8(symbol);
+        b->masks[LSCAN_SYMBOL] |= m << i;
+        m = (unsigned)_mm256_movemask_epi8(digit);
+        b->masks[LSCAN_DIGIT] |= m << i;
+    }
+}
+#endif
+
+static const char *lscan_names[] = {"scalar", "sse2", "avx2"};
+static lclassify lscan_kernels[] = {
+    lclassify_scalar,
+#ifdef LSCAN_X86
+    lclassify_sse2, lclassify_avx2,
+#endif
+};
+#define LSCAN_LEVELS (int)(sizeof(lscan_kernels) / sizeof(lscan_kernels[0]))
+
+static struct {
+    lclassify classify;
+    int level;  // Index into lscan_kernels
+} lval_scan;
+
+/* Picks the widest classifier the CPU supports, at most 'level' */
+int lscan_init(int level) {
+    int best = 0;
+#ifdef LSCAN_X86
+    __builtin_cpu_init();
+    best = __builtin_cpu_supports("avx2") ? 2 : 1;
+#endif
+    lval_scan.level = level < best ? level : best;
+    lval_scan.classify = lscan_kernels[lval_scan.level];
+    return lval_scan.level;
+}
+
+/* Classifies the block at 'p', bytes at or past 'e' are in no class */
+static void lscan_load(lblock *b, const char *p, const char *e) {
+    if (lval_scan.classify == NULL) {
+        lscan_init(2);
+    }
+    if (e - p >= 64) {
+        lval_scan.classify(p, b);
+    } else {
+        char tail[64] = {0};
+        memcpy(tail, p, e - p);
+        lval_scan.classify(tail, b);
+    }
+    b->base = p;
+}
+
+static inline int lscan_ctz(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* Skips the run of 'kind' characters starting at 'p' */
+static inline const char *lscan_span(lblock *b, const char *p, const char *e,
+                                     int kind) {
+    while (p < e) {
+        if (b->base == NULL || p >= b->base + 64) {
+            lscan_load(b, p, e);
+        }
+        int off = p - b->base;
+        /* Bits past the end of the block come in as zeros, so the run
+           stops there at the latest */
+        uint64_t stop = ~(b->masks[kind] >> off);
+        int n = stop ? lscan_ctz(stop) : 64;
+        p += n;
+        if (p < b->base + 64) {
+            break;
+        }
+    }
+    return p;
+}
+
+static void lreader_push(lval *v) {
+    lreader *r = &lval_reader;
+    if (r->count == r->capacity) {
+        lmem_sub(LMEM_AST, sizeof(lval *) * r->capacity);
+        r->capacity = r->capacity ? r->capacity * 2 : 32;
+        r->stack = realloc(r->stack, sizeof(lval *) * r->capacity);
+        lmem_add(LMEM_AST, sizeof(lval *) * r->capacity);
+    }
+    r->stack[r->count++] = v;
+}
+
+/* Reads the digits in [s, e), with an optional minus sign, failing like
+   strtol would when they do not fit a long */
+static lval *lread_num(const char *s, const char *e) {
+    int negative = *s == '-';
+    unsigned long limit = negative ? 0UL - LONG_MIN : LONG_MAX;
+    unsigned long x = 0;
+    for (s += negative; s < e; s++) {
+        unsigned d = *s - '0';
+        if (x > (limit - d) / 10) {
+            return lval_err("invalid number");
+        }
+        x = x * 10 + d;
+    }
+    return lval_num(negative ? (long)(0UL - x) : (long)x);
+}
+
+/* Reads the 'n' characters at 's', which need not be terminated. Symbols
+   and numbers are taken from it in place */
+lval *lval_read_n(const char *s, size_t n) {
+    lreader *r = &lval_reader;
+    const char *e = s + n;
+    lblock b = {NULL};
+    lreader_push(lval_sexpr());
+
+    while (1) {
+        s = lscan_span(&b, s, e, LSCAN_SPACE);
+        lval *top = r->stack[r->count - 1];
+
+        if (s == e) {
+            if (r->count > 1) {
+                break;
+            }
+            r->count = 0;
+            return top;
+        }
+        char c = *s;
+        if (c == '(' || c == '{') {
+            if (r->count > LREAD_MAX_DEPTH) {
+                break;
+            }
+            lreader_push(c == '(' ? lval_sexpr() : lval_qexpr());
+            s++;
+            continue;
+        }
+        if (c == ')' || c == '}') {
+            if (r->count == 1 ||
+                top->type != (c == ')' ? LVAL_SEXPR : LVAL_QEXPR)) {
+                break;
+            }
+            r->count--;
+            lval_add(r->stack[r->count - 1], top);
+            s++;
+            continue;
+        }
+
+        const char *p = s + 1;
+        lval *x;
+        if (lread_digit(c) || (c == '-' && p < e && lread_digit(*p))) {
+            p = lscan_span(&b, p, e, LSCAN_DIGIT);
+            x = lread_num(s, p);
+        } else if (lread_symbol(c)) {
+            p = lscan_span(&b, p, e, LSCAN_SYMBOL);
+            x = lval_sym_n(s, p - s);
+        } else {
+            break;
+        }
+        lval_add(top, x);
+        s = p;
+    }
+
+    /* Not valid, drop what was read */
+    while (r->count > 0) {
+        lval_del(r->stack[--r->count]);
+    }
+    return NULL;
+}
+
+void lval_reader_destroy(void) {
+    lreader *r = &lval_reader;
+    lmem_sub(LMEM_AST, sizeof(lval *) * r->capacity);
+    free(r->stack);
+    r->stack = NULL;
+    r->capacity = 0;
+}
+
+/*
+ * lval_eval keeps its work on a stack of frames on the heap rather than on
+ * the C stack. A frame is an S-expression whose cells have been evaluated
+ * up to 'next'. Each value produced is stored into the frame waiting for
+ * it, and a frame is applied once all of its cells are in.
+ *
+ * A call to eval replaces the frame of the call instead of running in a
+ * new one, so chains of evals run in constant space. Nesting more than
+ * 'max_depth' frames deep evaluates to an error. The limit can be set
+ * with --max-depth. Source is never nested deeper than LREAD_MAX_DEPTH,
+ * so deep frames come from evaluating lists built at run time.
+ */
+#ifndef LEVAL_MAX_DEPTH
+#define LEVAL_MAX_DEPTH 100000
+#endif
+
+typedef struct lframe {
+    lval *v;
+    int next;     // First cell still to be evaluated
+    lbuiltin fn;  // Builtin found through the call site cache, if any
+} lframe;
+
+typedef struct lstack {
+    lframe *frames;
+    int count;
+    int capacity;
+    int max_depth;
+} lstack;
+
+static lstack lval_stack = {NULL, 0, 0, LEVAL_MAX_DEPTH};
+
+/* Stands in for a cell while its value is being computed */
+#define LVAL_HOLE lval_fixnum(0)
+
+lval *builtin_eval(lenv *env, lval *a);
+lval *builtin_eval_expr(lval *a);
+
+/* Applies the S-expression 'v' whose cells are all evaluated. A call to
+   eval returns NULL and sets 'tail' to the expression to evaluate next */
+static lval *lval_apply(lenv *env, lval *v, lbuiltin fn, lval **tail) {
+    /* With a builtin from the call site cache the head is the symbol */
+    for (int i = fn ? 1 : 0; i < v->count; i++) {
+        if (lval_type(v->cell[i]) == LVAL_ERR) {
             return lval_take(v, i);
         }
     }
@@ -322,212 +1568,1784 @@ lval *lval_sexpr_eval(lenv *env, lval *v) {
     }
 
     lval *f = lval_pop(v, 0);
-
-    if (f->type != LVAL_FUNC) {
-        lval_del(f);
-        lval_del(v);
-        return lval_err("First element is not a function!");
+    lgc_root(f);
+    if (fn == NULL) {
+        if (lval_type(f) != LVAL_FUNC) {
+            lval_del(f);
+            lval_del(v);
+            return lval_err("First element is not a function!");
+        }
+        fn = f->func;
     }
-
-    lval *result = f->func(env, v);
     lval_del(f);
-    return result;
+
+    if (fn == builtin_eval) {
+        lval *x = builtin_eval_expr(v);
+        if (lval_type(x) == LVAL_ERR) {
+            return x;
+        }
+        *tail = x;
+        return NULL;
+    }
+    return fn(env, v);
 }
 
 lval *lval_eval(lenv *env, lval *v) {
-    if (v->type == LVAL_SYM) {
-        lval *x = lenv_get(env, v);
-        lval_del(v);
-        return x;
-    }
-    /* Evaluate Sexpressions */
-    if (v->type == LVAL_SEXPR) {
-        return lval_sexpr_eval(env, v);
+    lstack *s = &lval_stack;
+    int base = s->count;
+    lval *x = v;  // Next expression to evaluate
+    lval *r;      // Value it produced, NULL if it entered a frame
+
+    while (1) {
+        switch (lval_type(x)) {
+            case LVAL_SYM:
+                r = lenv_get(env, x);
+                lval_del(x);
+                break;
+
+            /* Evaluate Sexpressions */
+            case LVAL_SEXPR:
+                if (s->count >= s->max_depth) {
+                    lval_del(x);
+                    r = lval_err("Maximum evaluation depth exceeded!");
+                    break;
+                }
+                if (s->count == s->capacity) {
+                    lmem_sub(LMEM_STACK, sizeof(lframe) * s->capacity);
+                    s->capacity = s->capacity ? s->capacity * 2 : 64;
+                    s->frames = realloc(s->frames, sizeof(lframe) * s->capacity);
+                    lmem_add(LMEM_STACK, sizeof(lframe) * s->capacity);
+                }
+                x = lval_unshare(x);
+                lval_own(x);
+                lframe *f = &s->frames[s->count++];
+                f->v = x;
+                f->next = 0;
+                f->fn = NULL;
+
+                /* Calls to a builtin named by a resolved symbol skip
+                   looking up and copying the function value */
+                if (x->count > 1 && lval_type(x->cell[0]) == LVAL_SYM) {
+                    f->fn = lenv_get_builtin(env, x->cell[0]);
+                    f->next = f->fn ? 1 : 0;
+                }
+                lgc_safe_point(env);
+                r = NULL;
+                break;
+
+            default:
+                r = x;
+                break;
+        }
+
+        /* Hand values to the frames waiting for them until one of them
+           needs another cell evaluated */
+        while (1) {
+            if (r && s->count == base) {
+                return r;
+            }
+            lframe *f = &s->frames[s->count - 1];
+            if (r) {
+                f->v->cell[f->next++] = r;
+            }
+            if (f->next < f->v->count) {
+                x = f->v->cell[f->next];
+                f->v->cell[f->next] = LVAL_HOLE;
+                break;
+            }
+            s->count--;
+            x = NULL;
+            /* Builtins may evaluate, so keep the call reachable */
+            int depth = lgc_enter(env, f->v);
+            r = lval_apply(env, f->v, f->fn, &x);
+            lgc_leave(depth);
+            if (r == NULL) {
+                break;
+            }
+        }
     }
-    return v;
 }
 
+void lval_stack_destroy(void) {
+    lstack *s = &lval_stack;
+    lmem_sub(LMEM_STACK, sizeof(lframe) * s->capacity);
+    free(s->frames);
+    s->frames = NULL;
+    s->capacity = 0;
+}
+
+/*
+ * Bindings live in an open addressing table keyed by symbol id. Each entry
+ * keeps the hash of its name, taken from the intern table, so probing and
+ * growing never need to look at the symbol again. lenv_remove shifts later
+ * entries back rather than leaving tombstones behind.
+ *
+ * The value itself is held in a binding cell that stays at the same
+ * address for as long as the environment exists. Symbols remember the
+ * cell they were last found in, so once resolved they are looked up
+ * without touching the table. Redefining a symbol updates its cell in
+ * place, and removing it empties the cell, which sends the symbols still
+ * pointing at it back to the table.
+ *
+ * Both bump the cell's version. A symbol in call position records the
+ * version it saw, so while the two match the builtin cached in the cell
+ * can be called straight away, see lenv_get_builtin.
+ */
+struct lbind {
+    lval *val;  // NULL once the symbol has been removed
+    lbuiltin fn;  // Builtin 'val' holds, if any
+    unsigned version;
+    lenv *env;
+    lbind *next;  // All cells of 'env', freed with it
+};
+
+typedef struct lentry {
+    int sym;
+    unsigned hash;
+    lbind *bind;  // NULL for an empty entry
+} lentry;
+
 struct lenv {
     int count;
-    char **syms;
-    lval **vals;
+    int capacity;  // Always a power of two
+    lentry *entries;
+    lbind *binds;
 };
 
+#define LENV_MIN_CAPACITY 16
+
 lenv *lenv_new(void) {
     lenv *env = malloc(sizeof(lenv));
     env->count = 0;
-    env->syms = NULL;
-    env->vals = NULL;
+    env->capacity = LENV_MIN_CAPACITY;
+    env->entries = calloc(env->capacity, sizeof(lentry));
+    env->binds = NULL;
+    lmem_add(LMEM_ENV, sizeof(lenv) + sizeof(lentry) * env->capacity);
     return env;
 }
 
-lval *lenv_get(lenv *env, lval *a) {
-    for (int i = 0; i < env->count; i++) {
-        if (strcmp(env->syms[i], a->sym) == 0) {
-            return lval_copy(env->vals[i]);
+/* Returns the entry for 'sym', or the empty entry where it would go */
+static lentry *lenv_find(lenv *env, int sym, unsigned hash) {
+    unsigned mask = env->capacity - 1;
+    unsigned i = hash & mask;
+    while (env->entries[i].bind && env->entries[i].sym != sym) {
+        i = (i + 1) & mask;
+    }
+    return &env->entries[i];
+}
+
+static void lenv_grow(lenv *env) {
+    lentry *old = env->entries;
+    int capacity = env->capacity;
+    env->capacity *= 2;
+    env->entries = calloc(env->capacity, sizeof(lentry));
+    for (int i = 0; i < capacity; i++) {
+        if (old[i].bind) {
+            *lenv_find(env, old[i].sym, old[i].hash) = old[i];
         }
     }
+    free(old);
+    lmem_add(LMEM_ENV, sizeof(lentry) * (env->capacity - capacity));
+}
+
+/* Points the symbol 'a' at its binding in 'env', or at nothing if it is
+   unbound. Symbols are shared freely, this only refreshes a cache */
+static lbind *lenv_resolve(lenv *env, lval *a) {
+    a->bind = lenv_find(env, a->symid, lsym_hash_of(a->symid))->bind;
+    if (a->bind) {
+        a->version = a->bind->version;
+    }
+    return a->bind;
+}
+
+/* Sets the value of the cell 'b', which takes ownership of 'v' */
+static void lbind_set(lbind *b, lval *v) {
+    b->val = v;
+    b->fn = v && lval_type(v) == LVAL_FUNC ? v->func : NULL;
+    b->version++;
+}
+
+lval *lenv_get(lenv *env, lval *a) {
+    lbind *b = a->bind;
+    if (b == NULL || b->env != env || b->val == NULL) {
+        b = lenv_resolve(env, a);
+    }
+    if (b) {
+        return lval_retain(b->val);
+    }
     return lval_err("symbol not found!");
 }
 
+/* Returns the builtin 'a' is bound to without touching its value, or NULL
+   if it is bound to something else or not at all */
+lbuiltin lenv_get_builtin(lenv *env, lval *a) {
+    lbind *b = a->bind;
+    if (b == NULL || b->env != env || b->version != a->version) {
+        b = lenv_resolve(env, a);
+    }
+    return b ? b->fn : NULL;
+}
+
 void lenv_put(lenv *env, lval *k, lval *v) {
-    /* Iterate over all items in environment */
-    /* This is to see if variable already exists */
-    for (int i = 0; i < env->count; i++) {
-        /* If variable is found delete item at that position */
-        /* And replace with variable supplied by user */
-        if (strcmp(env->syms[i], k->sym) == 0) {
-            lval_del(env->vals[i]);
-            env->vals[i] = lval_copy(v);
-            return;
-        }
+    unsigned hash = lsym_hash_of(k->symid);
+    lentry *e = lenv_find(env, k->symid, hash);
+
+    /* If the variable already exists replace its value */
+    if (e->bind) {
+        v = lval_promote(lval_retain(v));
+        lval_del(e->bind->val);
+        lbind_set(e->bind, v);
+        return;
+    }
+
+    /* Keep the table at most half full */
+    if ((env->count + 1) * 2 > env->capacity) {
+        lenv_grow(env);
+        e = lenv_find(env, k->symid, hash);
     }
+    lbind *b = malloc(sizeof(lbind));
+    lmem_add(LMEM_ENV, sizeof(lbind));
+    b->version = 0;
+    lbind_set(b, lval_promote(lval_retain(v)));
+    b->env = env;
+    b->next = env->binds;
+    env->binds = b;
 
-    /* If no existing entry found allocate space for new entry */
     env->count++;
-    env->vals = realloc(env->vals, sizeof(lval *) * env->count);
-    env->syms = realloc(env->syms, sizeof(char *) * env->count);
+    e->sym = k->symid;
+    e->hash = hash;
+    e->bind = b;
+}
+
+/* Unbinds 'k', returning whether it was bound */
+int lenv_remove(lenv *env, lval *k) {
+    unsigned mask = env->capacity - 1;
+    lentry *e = lenv_find(env, k->symid, lsym_hash_of(k->symid));
+    if (e->bind == NULL) {
+        return 0;
+    }
+    /* The cell stays allocated for symbols that still point at it */
+    lval_del(e->bind->val);
+    lbind_set(e->bind, NULL);
+    env->count--;
 
-    /* Copy contents of lval and symbol string into new location */
-    env->vals[env->count - 1] = lval_copy(v);
-    env->syms[env->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(env->syms[env->count - 1], k->sym);
+    /* Move later entries of the probe run back into the hole whenever
+       their home slot does not lie between the hole and where they are */
+    unsigned hole = e - env->entries;
+    unsigned i = hole;
+    while (1) {
+        i = (i + 1) & mask;
+        lentry *x = &env->entries[i];
+        if (x->bind == NULL) {
+            break;
+        }
+        unsigned home = x->hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            env->entries[hole] = *x;
+            hole = i;
+        }
+    }
+    env->entries[hole].bind = NULL;
+    return 1;
 }
 
 void lenv_del(lenv *env) {
-    for (int i = 0; i < env->count; i++) {
-        free(env->syms[i]);
-        lval_del(env->vals[i]);
+    while (env->binds) {
+        lbind *next = env->binds->next;
+        if (env->binds->val) {
+            lval_del(env->binds->val);
+        }
+        lmem_sub(LMEM_ENV, sizeof(lbind));
+        free(env->binds);
+        env->binds = next;
     }
-    free(env->syms);
-    free(env->vals);
+    lmem_sub(LMEM_ENV, sizeof(lenv) + sizeof(lentry) * env->capacity);
+    free(env->entries);
     free(env);
 }
 
-/*!
-A little helper to check if lval is valid
-*/
-lval *head_tail_helper(lval *a) {
-    LASSERT(a, a->count == 1, "Function 'head' passed too many arguments!");
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-            "Function 'head' passed incorrect types!");
-    LASSERT(a, a->cell[0]->count != 0, "Function 'head' passed {}!");
-    return lval_num(1);
-}
-lval *builtin_list(lenv *env, lval *a) {
-    a->type = LVAL_QEXPR;
-    return a;
+/*
+ * Resolves every symbol in 'v' against 'env' ahead of evaluation, so a
+ * form that runs many times never looks its symbols up by name. Symbols
+ * that are not bound yet are resolved the first time they are evaluated.
+ */
+void lval_resolve(lenv *env, lval *v) {
+    switch (lval_type(v)) {
+        case LVAL_SYM:
+            lenv_resolve(env, v);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                lval_resolve(env, v->cell[i]);
+            }
+            break;
+    }
 }
 
-lval *builtin_eval(lenv *env, lval *a) {
-    LASSERT(a, a->count == 1, "Function 'eval' passed too many arguments!");
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-            "Function 'eval' passed incorrect type!");
-
-    lval *x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(env, x);
-}
 /*
-Takes a Q-Expression and returns a Q-Expression with only the first element
+ * Constant folding runs over each form after it is read. A call to a pure
+ * builtin whose arguments are all literals, such as (* 60 60 24), is
+ * replaced by its result. The builtin is whatever the symbol is bound to
+ * at the time, so after (def {+} -) a (+ 1 2) folds to -1, and a symbol
+ * bound to anything else is not folded at all.
+ *
+ * A form that might call def or eval is left alone, since a binding that
+ * changes part way through could change what the fold meant. Q-expressions
+ * are data and are never folded. Calls whose result is an error are left
+ * for evaluation to report.
  */
-lval *builtin_head(lenv *env, lval *a) {
-    lval *res = head_tail_helper(a);
-    if (res->type == LVAL_ERR) {
-        return res;
-    }
-    lval_del(res);
+typedef struct lfold {
+    int disabled;  // --no-fold
+    long forms;
+    long skipped;  // Forms left alone because they might rebind
+    long folded;   // Calls replaced by their result
+} lfold;
 
-    lval *v = lval_take(a, 0);
+static lfold lval_fold_stats;
 
-    while (v->count > 1) {
-        lval_del(lval_pop(v, 1));
+/* Whether evaluating 'v' might call a builtin that binds symbols */
+static int lval_fold_binds(lenv *env, lval *v) {
+    switch (lval_type(v)) {
+        case LVAL_SYM: {
+            lbind *b = lenv_resolve(env, v);
+            return b && b->fn && (lbuiltin_flags(b->fn) & LFN_BINDS);
+        }
+        case LVAL_SEXPR:
+            for (int i = 0; i < v->count; i++) {
+                if (lval_fold_binds(env, v->cell[i])) {
+                    return 1;
+                }
+            }
+            return 0;
     }
-    return v;
+    return 0;
 }
 
-/*
-Takes a Q-Expression and returns a Q-Expression with the first element removed
-*/
-lval *builtin_tail(lenv *env, lval *a) {
-    lval *res = head_tail_helper(a);
-    if (res->type == LVAL_ERR) {
-        return res;
+static lval *lval_fold_expr(lenv *env, lval *v) {
+    if (lval_type(v) != LVAL_SEXPR) {
+        return v;
+    }
+    lval_own(v);
+    for (int i = 0; i < v->count; i++) {
+        v->cell[i] = lval_fold_expr(env, v->cell[i]);
     }
-    lval_del(res);
-
-    lval *v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
-    return v;
-}
 
-lval *builtin_join(lenv *env, lval *a) {
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
-                "Function 'join' passed incorrect type");
+    if (v->count < 2 || lval_type(v->cell[0]) != LVAL_SYM) {
+        return v;
     }
-    lval *x = lval_pop(a, 0);
-    while (a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    lbind *b = lenv_resolve(env, v->cell[0]);
+    if (b == NULL || b->fn == NULL || !(lbuiltin_flags(b->fn) & LFN_PURE)) {
+        return v;
+    }
+    for (int i = 1; i < v->count; i++) {
+        int t = lval_type(v->cell[i]);
+        if (t != LVAL_NUM && t != LVAL_QEXPR) {
+            return v;
+        }
     }
 
-    lval_del(a);
+    lval *args = lval_sexpr();
+    lval_reserve(args, v->count - 1);
+    for (int i = 1; i < v->count; i++) {
+        lval_add(args, lval_retain(v->cell[i]));
+    }
+    lval *x = b->fn(env, args);
+    if (lval_type(x) == LVAL_ERR) {
+        lval_del(x);
+        return v;
+    }
+    lval_del(v);
+    lval_fold_stats.folded++;
     return x;
 }
 
-lval *builtin_op(lenv *env, lval *a, char *op) {
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_NUM,
-                "Cannot operate on non-number!");
-        // if (a->cell[i]->type != LVAL_NUM) {
-        //     // lval_del(a);
-        //     return lval_err("Cannot operate on non-number!");
-        // }
+/* Takes ownership of a freshly read form and returns it folded */
+lval *lval_fold(lenv *env, lval *v) {
+    if (lval_fold_stats.disabled) {
+        return v;
+    }
+    lval_fold_stats.forms++;
+    if (lval_fold_binds(env, v)) {
+        lval_fold_stats.skipped++;
+        return v;
     }
+    return lval_fold_expr(env, v);
+}
 
-    lval *x = lval_pop(a, 0);
+void lval_fold_print_stats(void) {
+    lfold *f = &lval_fold_stats;
+    printf("fold: %li calls folded in %li forms, %li forms skipped%s\n",
+           f->folded, f->forms, f->skipped, f->disabled ? " (disabled)" : "");
+}
 
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
-    }
+/*
+ * With --vm forms are compiled to bytecode for a small stack machine
+ * instead of being walked by lval_eval. Compiling flattens nested
+ * S-expressions into one sequence of pushes and calls, and the result is
+ * kept on the list's cell buffer, so running the same list again through
+ * eval starts straight from the bytecode. Results are the same as with
+ * lval_eval.
+ */
+enum {
+    LOP_CONST,  // Push a constant
+    LOP_SYM,    // Push the value bound to a symbol constant
+    LOP_CALL,   // Evaluate the top N values as an S-expression
+    LOP_RET,
 
-    while (a->count > 0) {
-        /* Pop the next element */
-        lval *y = lval_pop(a, 0);
+    /* Register mode, operands name registers of the current frame */
+    LOP_LOADK,    // dst, constant
+    LOP_LOADSYM,  // dst, symbol constant
+    LOP_CALLW,    // dst, N: evaluate registers dst.. dst+N-1 into dst
+    LOP_RETR,     // src
+    LOP_COUNT
+};
 
-        if (strcmp(op, "+") == 0) {
-            x->num += y->num;
-        }
-        if (strcmp(op, "-") == 0) {
-            x->num -= y->num;
-        }
-        if (strcmp(op, "*") == 0) {
-            x->num *= y->num;
-        }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division By Zero!");
-                break;
-            }
-            x->num /= y->num;
-        }
+/*
+ * With GCC or Clang the VM is direct threaded: once compiled, every
+ * opcode is replaced by the address of its handler, and each handler
+ * jumps straight to the next one. Build with -DLVM_SWITCH to use the
+ * portable switch loop instead.
+ */
+#if defined(__GNUC__) && !defined(LVM_SWITCH)
+#define LVM_THREADED
 
-        lval_del(y);
-    }
-    lval_del(a);
-    return x;
-}
-lval *builtin_add(lenv *env, lval *a) { return builtin_op(env, a, "+"); }
+/* Operands following each opcode */
+static const int lop_operands[LOP_COUNT] = {1, 1, 1, 0, 2, 2, 2, 1};
+#endif
 
-lval *builtin_sub(lenv *env, lval *a) { return builtin_op(env, a, "-"); }
+/*
+ * Constants are borrowed from the list that was compiled. Its buffer holds
+ * them for as long as the bytecode is cached on it, and bytecode that is
+ * not cached only lives while the list is being run.
+ */
+typedef struct lcode {
+    int start;  // View of the buffer this was compiled from
+    int count;
 
-lval *builtin_mul(lenv *env, lval *a) { return builtin_op(env, a, "*"); }
+    intptr_t *ops;  // Opcodes, or handler addresses when threaded
+    int op_count;
+    int op_capacity;
 
-lval *builtin_div(lenv *env, lval *a) { return builtin_op(env, a, "/"); }
+    lval **consts;
+    int const_count;
+    int const_capacity;
 
-void lenv_add_builtin(lenv *env, char *name, lbuiltin func) {
+    int max_stack;  // Deepest the stack gets, or registers in the frame
+    int registers;  // Compiled for register mode
+    int running;    // Runs in progress, it must not be replaced until done
+
+    int hits;              // Runs toward native compilation, -1 if refused
+    int bails;             // Times the native code bailed out
+    void *native;          // Machine code (--jit), or NULL
+    size_t native_size;    // Bytes mapped for it
+    int native_registers;  // Registers its frame needs
+} lcode;
+
+/*
+ * In register mode ('--vm-registers') each run gets a frame of registers
+ * on the stack, and every instruction names the registers it uses. A call
+ * leaves its arguments where they were computed and passes the builtin a
+ * pointer to them, so no argument list is built, see lvm_call_window.
+ */
+typedef struct lvm {
+    int enabled;
+    int registers;
+    lval **stack;
+    int sp;
+    int capacity;
+    int depth;  // lvm_eval calls in progress, see lval_stack.max_depth
+    uintptr_t stack_base;  // C stack pointer of the outermost lvm_eval
+    size_t stack_bytes;    // C stack lvm_eval calls may use, see LVM_STACK
+} lvm;
+
+static lvm lval_vm;
+
+static size_t lcode_size(lcode *code) {
+    return sizeof(lcode) + sizeof(intptr_t) * code->op_capacity +
+           sizeof(lval *) * code->const_capacity;
+}
+
+#ifdef LVAL_JIT
+void ljit_free(lcode *code);
+#endif
+
+void lcode_free(lcode *code) {
+    if (code == NULL) {
+        return;
+    }
+#ifdef LVAL_JIT
+    ljit_free(code);
+#endif
+    lmem_sub(LMEM_CODE, lcode_size(code));
+    free(code->ops);
+    free(code->consts);
+    free(code);
+}
+
+static void lcode_emit(lcode *code, intptr_t op) {
+    if (code->op_count == code->op_capacity) {
+        code->op_capacity = code->op_capacity ? code->op_capacity * 2 : 16;
+        code->ops = realloc(code->ops, sizeof(intptr_t) * code->op_capacity);
+    }
+    code->ops[code->op_count++] = op;
+}
+
+static int lcode_const(lcode *code, lval *v) {
+    if (code->const_count == code->const_capacity) {
+        code->const_capacity =
+            code->const_capacity ? code->const_capacity * 2 : 8;
+        code->consts =
+            realloc(code->consts, sizeof(lval *) * code->const_capacity);
+    }
+    code->consts[code->const_count] = v;
+    return code->const_count++;
+}
+
+/* Emits code that pushes the value of 'v', 'depth' values being on the
+   stack already */
+static void lcode_compile_expr(lcode *code, lval *v, int depth) {
+    if (depth + 1 > code->max_stack) {
+        code->max_stack = depth + 1;
+    }
+    switch (lval_type(v)) {
+        case LVAL_SYM:
+            lcode_emit(code, LOP_SYM);
+            lcode_emit(code, lcode_const(code, v));
+            break;
+        case LVAL_SEXPR:
+            for (int i = 0; i < v->count; i++) {
+                lcode_compile_expr(code, v->cell[i], depth + i);
+            }
+            lcode_emit(code, LOP_CALL);
+            lcode_emit(code, v->count);
+            break;
+        default:
+            lcode_emit(code, LOP_CONST);
+            lcode_emit(code, lcode_const(code, v));
+            break;
+    }
+}
+
+#ifdef LVM_THREADED
+/* Handler addresses by opcode, filled in by lvm_run */
+static const void *const *lvm_labels;
+#endif
+
+lval *lvm_run(lenv *env, lcode *code);
+
+/* Emits code that leaves the value of 'v' in register 'dst' */
+static void lcode_compile_reg(lcode *code, lval *v, int dst) {
+    if (dst + 1 > code->max_stack) {
+        code->max_stack = dst + 1;
+    }
+    switch (lval_type(v)) {
+        case LVAL_SYM:
+            lcode_emit(code, LOP_LOADSYM);
+            lcode_emit(code, dst);
+            lcode_emit(code, lcode_const(code, v));
+            break;
+        case LVAL_SEXPR:
+            for (int i = 0; i < v->count; i++) {
+                lcode_compile_reg(code, v->cell[i], dst + i);
+            }
+            lcode_emit(code, LOP_CALLW);
+            lcode_emit(code, dst);
+            lcode_emit(code, v->count);
+            break;
+        default:
+            lcode_emit(code, LOP_LOADK);
+            lcode_emit(code, dst);
+            lcode_emit(code, lcode_const(code, v));
+            break;
+    }
+}
+
+/* Compiles the S-expression 'v' for the current mode */
+lcode *lcode_compile(lval *v) {
+    lcode *code = calloc(1, sizeof(lcode));
+    code->start = v->start;
+    code->count = v->count;
+    code->registers = lval_vm.registers;
+    if (code->registers) {
+        lcode_compile_reg(code, v, 0);
+        lcode_emit(code, LOP_RETR);
+        lcode_emit(code, 0);
+    } else {
+        lcode_compile_expr(code, v, 0);
+        lcode_emit(code, LOP_RET);
+    }
+#ifdef LVM_THREADED
+    if (lvm_labels == NULL) {
+        lvm_run(NULL, NULL);
+    }
+    for (int i = 0; i < code->op_count;) {
+        int op = code->ops[i];
+        code->ops[i] = (intptr_t)lvm_labels[op];
+        i += 1 + lop_operands[op];
+    }
+#endif
+    lmem_add(LMEM_CODE, lcode_size(code));
+    return code;
+}
+
+/* Returns bytecode for 'v', compiling it unless its buffer has it. Sets
+   'owned' if the caller has to free it */
+lcode *lval_code(lval *v, int *owned) {
+    lcells *c = lval_cells(v);
+    *owned = 0;
+    if (c && c->code && c->code->start == v->start &&
+        c->code->count == v->count &&
+        c->code->registers == lval_vm.registers) {
+        return c->code;
+    }
+    lcode *code = lcode_compile(v);
+#ifndef LVAL_ARENA
+    /* Arena buffers are never freed one by one, and heap buffers may have
+       their slots swapped by lval_promote_cells, so nothing is cached
+       with LVAL_ARENA */
+    if (c && !(c->code && c->code->running)) {
+        lcode_free(c->code);
+        c->code = code;
+        return code;
+    }
+#endif
+    *owned = 1;
+    return code;
+}
+
+static void lvm_reserve(int n) {
+    lvm *vm = &lval_vm;
+    if (vm->sp + n <= vm->capacity) {
+        return;
+    }
+    lmem_sub(LMEM_CODE, sizeof(lval *) * vm->capacity);
+    while (vm->sp + n > vm->capacity) {
+        vm->capacity = vm->capacity ? vm->capacity * 2 : 256;
+    }
+    vm->stack = realloc(vm->stack, sizeof(lval *) * vm->capacity);
+    lmem_add(LMEM_CODE, sizeof(lval *) * vm->capacity);
+}
+
+/* Replaces the top 'n' values with the result of evaluating them as an
+   S-expression, the same way lval_apply does */
+static void lvm_call(lenv *env, int n) {
+    lvm *vm = &lval_vm;
+    int top = vm->sp - n;
+    lval **s = vm->stack + top;
+    lval *x;
+
+    for (int i = 0; i < n; i++) {
+        if (lval_type(s[i]) == LVAL_ERR) {
+            x = s[i];
+            for (int j = 0; j < n; j++) {
+                if (j != i) {
+                    lval_del(s[j]);
+                }
+            }
+            vm->sp = top;
+            vm->stack[vm->sp++] = x;
+            return;
+        }
+    }
+
+    if (n == 0) {
+        vm->stack[vm->sp++] = lval_sexpr();
+        return;
+    }
+    if (n == 1) {
+        return;
+    }
+
+    lval *f = s[0];
+    if (lval_type(f) != LVAL_FUNC) {
+        for (int i = 0; i < n; i++) {
+            lval_del(s[i]);
+        }
+        vm->sp = top;
+        vm->stack[vm->sp++] = lval_err("First element is not a function!");
+        return;
+    }
+
+    /* Safe point, everything still on the stack is a root */
+    int depth = lgc_enter(env, f);
+    lval *args = lval_sexpr();
+    lval_reserve(args, n - 1);
+    for (int i = 1; i < n; i++) {
+        lval_add(args, s[i]);
+    }
+    vm->sp = top;
+    lgc_root(args);
+
+    /* The builtin may run the VM again, which can move the stack */
+    x = f->func(env, args);
+    lgc_leave(depth);
+    lval_del(f);
+    vm->stack[vm->sp++] = x;
+}
+
+#ifdef LVM_THREADED
+#define LVM_NEXT() goto *(const void *)*ip++
+#define LVM_DISPATCH() LVM_NEXT();
+#define LVM_OP(op) L_##op:
+#else
+#define LVM_DISPATCH() \
+    while (1)          \
+        switch (*ip++)
+#define LVM_OP(op) case op:
+#define LVM_NEXT() break
+#endif
+
+/* Evaluates registers dst.. dst+n-1 of the frame at 'base' as an
+   S-expression, leaving the result in dst and clearing the rest */
+static void lvm_call_window(lenv *env, int base, int dst, int n) {
+    lvm *vm = &lval_vm;
+    lval **w = vm->stack + base + dst;
+    lval *x;
+
+    for (int i = 0; i < n; i++) {
+        if (lval_type(w[i]) == LVAL_ERR) {
+            x = w[i];
+            for (int j = 0; j < n; j++) {
+                if (j != i) {
+                    lval_del(w[j]);
+                }
+                w[j] = NULL;
+            }
+            w[0] = x;
+            return;
+        }
+    }
+
+    if (n == 0) {
+        w[0] = lval_sexpr();
+        return;
+    }
+    if (n == 1) {
+        return;
+    }
+
+    lval *f = w[0];
+    if (lval_type(f) != LVAL_FUNC) {
+        for (int i = 0; i < n; i++) {
+            lval_del(w[i]);
+            w[i] = NULL;
+        }
+        w[0] = lval_err("First element is not a function!");
+        return;
+    }
+
+    if (f->win) {
+        x = f->win(env, w + 1, n - 1);
+        for (int i = 1; i < n; i++) {
+            lval_del(w[i]);
+            w[i] = NULL;
+        }
+    } else {
+        /* Safe point, the frame is still rooted */
+        int depth = lgc_enter(env, f);
+        lval *args = lval_sexpr();
+        lval_reserve(args, n - 1);
+        for (int i = 1; i < n; i++) {
+            lval_add(args, w[i]);
+            w[i] = NULL;
+        }
+        lgc_root(args);
+
+        /* The builtin may run the VM again, which can move the stack */
+        x = f->func(env, args);
+        lgc_leave(depth);
+    }
+    lval_del(f);
+    vm->stack[base + dst] = x;
+}
+
+/* Runs 'code' and returns its result. Called with no code it only fills
+   in lvm_labels */
+lval *lvm_run(lenv *env, lcode *code) {
+#ifdef LVM_THREADED
+    static const void *const labels[LOP_COUNT] = {
+        &&L_LOP_CONST, &&L_LOP_SYM,     &&L_LOP_CALL,  &&L_LOP_RET,
+        &&L_LOP_LOADK, &&L_LOP_LOADSYM, &&L_LOP_CALLW, &&L_LOP_RETR};
+    if (code == NULL) {
+        lvm_labels = labels;
+        return NULL;
+    }
+#endif
+    lvm *vm = &lval_vm;
+    lvm_reserve(code->max_stack);
+    intptr_t *ip = code->ops;
+
+    /* Registers start out empty so the collector can skip them */
+    int base = vm->sp;
+    if (code->registers) {
+        memset(vm->stack + base, 0, sizeof(lval *) * code->max_stack);
+        vm->sp += code->max_stack;
+    }
+#define R(i) vm->stack[base + (i)]
+
+    LVM_DISPATCH() {
+        LVM_OP(LOP_CONST) {
+            vm->stack[vm->sp++] = lval_retain(code->consts[*ip++]);
+            LVM_NEXT();
+        }
+        LVM_OP(LOP_SYM) {
+            vm->stack[vm->sp++] = lenv_get(env, code->consts[*ip++]);
+            LVM_NEXT();
+        }
+        LVM_OP(LOP_CALL) {
+            lvm_call(env, *ip++);
+            LVM_NEXT();
+        }
+        LVM_OP(LOP_RET) { return vm->stack[--vm->sp]; }
+
+        LVM_OP(LOP_LOADK) {
+            R(ip[0]) = lval_retain(code->consts[ip[1]]);
+            ip += 2;
+            LVM_NEXT();
+        }
+        LVM_OP(LOP_LOADSYM) {
+            R(ip[0]) = lenv_get(env, code->consts[ip[1]]);
+            ip += 2;
+            LVM_NEXT();
+        }
+        LVM_OP(LOP_CALLW) {
+            lvm_call_window(env, base, ip[0], ip[1]);
+            ip += 2;
+            LVM_NEXT();
+        }
+        LVM_OP(LOP_RETR) {
+            lval *x = R(ip[0]);
+            vm->sp = base;
+            return x;
+        }
+    }
+#undef R
+#ifndef LVM_THREADED
+    return NULL;
+#endif
+}
+
+/*
+ * With --jit, forms that eval runs often enough are compiled to x86-64
+ * machine code. The JIT sits on top of the VM: bytecode cached on a list
+ * counts its runs, and after LJIT_THRESHOLD of them the list is compiled
+ * again, this time into a template of machine code for every cell.
+ *
+ * Only forms built from numbers, symbols, Q-expressions and calls to
+ * + - * / head tail and list are compiled. Arithmetic is done inline on
+ * fixnums, the list functions are called through their window entry
+ * points. Anything unusual at run time (a rebound builtin, an unbound
+ * symbol, a number that is not a fixnum, overflow, an error from a
+ * builtin) makes the code bail out, and since every compiled form is pure
+ * the VM simply runs it again from the start. Build with -DLVAL_NO_JIT to
+ * leave it out.
+ */
+#ifdef LVAL_JIT
+
+#ifndef LJIT_THRESHOLD
+#define LJIT_THRESHOLD 8
+#endif
+
+/* Times a form may bail out and be compiled again before it is left to
+   the VM for good */
+#ifndef LJIT_MAX_BAILS
+#define LJIT_MAX_BAILS 4
+#endif
+
+/* Native entry point, returns 0 to bail out. 'frame' has one register
+   per cell like the VM's register mode, and the result ends up in the
+   first */
+typedef int (*ljit_fn)(lenv *env, lval **frame);
+
+typedef struct ljit {
+    int enabled;
+    long compiled;
+    long refused;
+    long runs;
+    long bails;
+} ljit;
+
+static ljit lval_jit;
+
+lval *builtin_head(lenv *env, lval *a);
+lval *builtin_tail(lenv *env, lval *a);
+lval *builtin_list(lenv *env, lval *a);
+lval *builtin_add(lenv *env, lval *a);
+lval *builtin_sub(lenv *env, lval *a);
+lval *builtin_mul(lenv *env, lval *a);
+lval *builtin_div(lenv *env, lval *a);
+
+/* Machine code being assembled, and the jumps to patch to the bail out */
+typedef struct lasm {
+    unsigned char *code;
+    int count;
+    int capacity;
+    int *bails;
+    int bail_count;
+    int bail_capacity;
+    lenv *env;
+    int registers;
+} lasm;
+
+static void lasm_bytes(lasm *a, const void *p, int n) {
+    while (a->count + n > a->capacity) {
+        a->capacity = a->capacity ? a->capacity * 2 : 256;
+        a->code = realloc(a->code, a->capacity);
+    }
+    memcpy(a->code + a->count, p, n);
+    a->count += n;
+}
+
+#define LASM(a, ...)                                           \
+    do {                                                       \
+        static const unsigned char bytes_[] = {__VA_ARGS__};   \
+        lasm_bytes(a, bytes_, sizeof(bytes_));                 \
+    } while (0)
+
+static void lasm_u32(lasm *a, uint32_t x) { lasm_bytes(a, &x, 4); }
+static void lasm_u64(lasm *a, uint64_t x) { lasm_bytes(a, &x, 8); }
+
+/* Conditional jump to the bail out, 'cc' is the second opcode byte */
+static void lasm_bail_if(lasm *a, unsigned char cc) {
+    unsigned char op[2] = {0x0f, cc};
+    lasm_bytes(a, op, 2);
+    if (a->bail_count == a->bail_capacity) {
+        a->bail_capacity = a->bail_capacity ? a->bail_capacity * 2 : 16;
+        a->bails = realloc(a->bails, sizeof(int) * a->bail_capacity);
+    }
+    a->bails[a->bail_count++] = a->count;
+    lasm_u32(a, 0);
+}
+
+#define LJIT_JZ 0x84
+#define LJIT_JNZ 0x85
+#define LJIT_JO 0x80
+
+/* mov rax, imm64 */
+static void lasm_mov_rax(lasm *a, uint64_t x) {
+    LASM(a, 0x48, 0xb8);
+    lasm_u64(a, x);
+}
+
+/* mov rcx, [rbx + 8 * r] */
+static void lasm_load_rcx(lasm *a, int r) {
+    LASM(a, 0x48, 0x8b, 0x8b);
+    lasm_u32(a, 8 * r);
+}
+
+/* mov [rbx + 8 * r], rax */
+static void lasm_store_rax(lasm *a, int r) {
+    LASM(a, 0x48, 0x89, 0x83);
+    lasm_u32(a, 8 * r);
+}
+
+/* Calls the C function 'f', arguments already in place */
+static void lasm_call(lasm *a, void *f) {
+    lasm_mov_rax(a, (uint64_t)(uintptr_t)f);
+    LASM(a, 0xff, 0xd0);  // call rax
+}
+
+static lval *ljit_retain(lval *v) { return lval_retain(v); }
+
+/* Calls 'fn' on the 'n' values at 'args', releasing them. Returns NULL if
+   the result is an error, the VM will report it */
+static lval *ljit_apply(lenv *env, lval **args, int n, lbuiltin fn) {
+    lwindow win = lbuiltin_window(fn);
+    lval *x;
+    if (win) {
+        x = win(env, args, n);
+        for (int i = 0; i < n; i++) {
+            lval_del(args[i]);
+            args[i] = NULL;
+        }
+    } else {
+        lval *a = lval_sexpr();
+        lval_reserve(a, n);
+        for (int i = 0; i < n; i++) {
+            lval_add(a, args[i]);
+            args[i] = NULL;
+        }
+        x = fn(env, a);
+    }
+    if (lval_type(x) == LVAL_ERR) {
+        lval_del(x);
+        return NULL;
+    }
+    return x;
+}
+
+static int ljit_compile_expr(lasm *a, lval *v, int dst);
+
+/* Inline fixnum arithmetic over registers dst+1 .. dst+n into dst. It
+   wraps around like the unsigned accumulator of LVAL_ARITH */
+static void ljit_compile_arith(lasm *a, lbuiltin fn, int dst, int n) {
+    for (int i = 1; i <= n; i++) {
+        lasm_load_rcx(a, dst + i);
+        LASM(a, 0xf6, 0xc1, 0x01);  // test cl, 1
+        lasm_bail_if(a, LJIT_JZ);
+        LASM(a, 0x48, 0xd1, 0xf9);  // sar rcx, 1
+        if (i == 1) {
+            LASM(a, 0x48, 0x89, 0xc8);  // mov rax, rcx
+            if (n == 1 && fn == builtin_sub) {
+                LASM(a, 0x48, 0xf7, 0xd8);  // neg rax
+            }
+        } else if (fn == builtin_add) {
+            LASM(a, 0x48, 0x01, 0xc8);  // add rax, rcx
+        } else if (fn == builtin_sub) {
+            LASM(a, 0x48, 0x29, 0xc8);  // sub rax, rcx
+        } else if (fn == builtin_mul) {
+            LASM(a, 0x48, 0x0f, 0xaf, 0xc1);  // imul rax, rcx
+        } else {
+            /* Dividing by -1 may trap, leave that and zero to the VM */
+            LASM(a, 0x48, 0x85, 0xc9);  // test rcx, rcx
+            lasm_bail_if(a, LJIT_JZ);
+            LASM(a, 0x48, 0x83, 0xf9, 0xff);  // cmp rcx, -1
+            lasm_bail_if(a, LJIT_JZ);
+            LASM(a, 0x48, 0x99, 0x48, 0xf7, 0xf9);  // cqo; idiv rcx
+        }
+    }
+    /* Tag the result, bailing out if it needs a boxed number */
+    LASM(a, 0x48, 0x01, 0xc0);  // add rax, rax
+    lasm_bail_if(a, LJIT_JO);
+    LASM(a, 0x48, 0x83, 0xc8, 0x01);  // or rax, 1
+    lasm_store_rax(a, dst);
+}
+
+/* Emits code that leaves the value of 'v' in register 'dst'. Returns 0 if
+   'v' is not something the JIT handles */
+static int ljit_compile_expr(lasm *a, lval *v, int dst) {
+    if (dst + 1 > a->registers) {
+        a->registers = dst + 1;
+    }
+    switch (lval_type(v)) {
+        case LVAL_SYM: {
+            lbind *b = v->bind;
+            if (b == NULL || b->env != a->env || b->val == NULL) {
+                b = lenv_resolve(a->env, v);
+            }
+            if (b == NULL) {
+                return 0;
+            }
+            /* The binding may change, so its value is read each run */
+            lasm_mov_rax(a, (uint64_t)(uintptr_t)&b->val);
+            LASM(a, 0x48, 0x8b, 0x00);  // mov rax, [rax]
+            LASM(a, 0x48, 0x85, 0xc0);  // test rax, rax
+            lasm_bail_if(a, LJIT_JZ);
+            LASM(a, 0xa8, 0x01);        // test al, 1
+            LASM(a, 0x75, 0x0f);        // jnz past the 15 bytes of retain
+            LASM(a, 0x48, 0x89, 0xc7);  // mov rdi, rax
+            lasm_call(a, ljit_retain);
+            lasm_store_rax(a, dst);
+            return 1;
+        }
+        case LVAL_SEXPR:
+            break;
+        case LVAL_NUM:
+            if (lval_is_fixnum(v)) {
+                lasm_mov_rax(a, (uint64_t)(uintptr_t)v);
+                lasm_store_rax(a, dst);
+                return 1;
+            }
+            /* fall through */
+        default:
+            /* Borrowed from the list like the VM's constants */
+            LASM(a, 0x48, 0xbf);  // mov rdi, imm64
+            lasm_u64(a, (uint64_t)(uintptr_t)v);
+            lasm_call(a, ljit_retain);
+            lasm_store_rax(a, dst);
+            return 1;
+    }
+
+    if (v->count < 2 || lval_type(v->cell[0]) != LVAL_SYM) {
+        return 0;
+    }
+    lval *head = v->cell[0];
+    lbuiltin fn = lenv_get_builtin(a->env, head);
+    if (fn != builtin_add && fn != builtin_sub && fn != builtin_mul &&
+        fn != builtin_div && fn != builtin_head && fn != builtin_tail &&
+        fn != builtin_list) {
+        return 0;
+    }
+    for (int i = 1; i < v->count; i++) {
+        if (!ljit_compile_expr(a, v->cell[i], dst + i)) {
+            return 0;
+        }
+    }
+
+    /* Bail out if the symbol was bound to something else since */
+    lasm_mov_rax(a, (uint64_t)(uintptr_t)&head->bind->version);
+    LASM(a, 0x8b, 0x00);  // mov eax, [rax]
+    LASM(a, 0x3d);        // cmp eax, imm32
+    lasm_u32(a, head->bind->version);
+    lasm_bail_if(a, LJIT_JNZ);
+
+    if (fn == builtin_head || fn == builtin_tail || fn == builtin_list) {
+        LASM(a, 0x4c, 0x89, 0xe7);  // mov rdi, r12
+        LASM(a, 0x48, 0x8d, 0xb3);  // lea rsi, [rbx + disp32]
+        lasm_u32(a, 8 * (dst + 1));
+        LASM(a, 0xba);  // mov edx, imm32
+        lasm_u32(a, v->count - 1);
+        LASM(a, 0x48, 0xb9);  // mov rcx, imm64
+        lasm_u64(a, (uint64_t)(uintptr_t)fn);
+        lasm_call(a, ljit_apply);
+        LASM(a, 0x48, 0x85, 0xc0);  // test rax, rax
+        lasm_bail_if(a, LJIT_JZ);
+        lasm_store_rax(a, dst);
+    } else {
+        ljit_compile_arith(a, fn, dst, v->count - 1);
+    }
+    return 1;
+}
+
+/* Compiles 'v' into executable pages attached to 'code'. Returns 0 if
+   the form cannot be compiled */
+static int ljit_compile(lenv *env, lcode *code, lval *v) {
+    lasm a = {0};
+    a.env = env;
+
+    /* r13 is only saved to keep the stack aligned for calls */
+    LASM(&a, 0x53, 0x41, 0x54, 0x41, 0x55);  // push rbx; push r12; push r13
+    LASM(&a, 0x48, 0x89, 0xf3);              // mov rbx, rsi
+    LASM(&a, 0x49, 0x89, 0xfc);              // mov r12, rdi
+
+    /* Symbols were resolved against this environment */
+    lasm_mov_rax(&a, (uint64_t)(uintptr_t)env);
+    LASM(&a, 0x49, 0x39, 0xc4);  // cmp r12, rax
+    lasm_bail_if(&a, LJIT_JNZ);
+
+    int ok = ljit_compile_expr(&a, v, 0);
+
+    LASM(&a, 0xb8, 0x01, 0x00, 0x00, 0x00);  // mov eax, 1
+    LASM(&a, 0x41, 0x5d, 0x41, 0x5c, 0x5b);  // pop r13; pop r12; pop rbx
+    LASM(&a, 0xc3);                          // ret
+    int bail = a.count;
+    LASM(&a, 0x31, 0xc0);                    // xor eax, eax
+    LASM(&a, 0x41, 0x5d, 0x41, 0x5c, 0x5b);  // pop r13; pop r12; pop rbx
+    LASM(&a, 0xc3);                          // ret
+
+    void *p = MAP_FAILED;
+    size_t size = 0;
+    if (ok) {
+        for (int i = 0; i < a.bail_count; i++) {
+            int32_t rel = bail - (a.bails[i] + 4);
+            memcpy(a.code + a.bails[i], &rel, 4);
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        size = (a.count + page - 1) / page * page;
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (p != MAP_FAILED) {
+        memcpy(p, a.code, a.count);
+        if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(p, size);
+            p = MAP_FAILED;
+        }
+    }
+    free(a.code);
+    free(a.bails);
+    if (p == MAP_FAILED) {
+        lval_jit.refused++;
+        return 0;
+    }
+
+    code->native = p;
+    code->native_size = size;
+    code->native_registers = a.registers;
+    lmem_add(LMEM_CODE, size);
+    lval_jit.compiled++;
+    return 1;
+}
+
+void ljit_free(lcode *code) {
+    if (code->native) {
+        lmem_sub(LMEM_CODE, code->native_size);
+        munmap(code->native, code->native_size);
+        code->native = NULL;
+        code->native_size = 0;
+    }
+}
+
+/* Runs the native code for 'v', compiling it once it is hot. Returns
+   NULL if the VM has to run it instead */
+static lval *ljit_run(lenv *env, lcode *code, lval *v) {
+    if (code->native == NULL) {
+        if (code->hits < 0 || ++code->hits < LJIT_THRESHOLD) {
+            return NULL;
+        }
+        if (!ljit_compile(env, code, v)) {
+            code->hits = -1;
+            return NULL;
+        }
+    }
+
+    lvm *vm = &lval_vm;
+    int n = code->native_registers;
+    lvm_reserve(n);
+    int base = vm->sp;
+    memset(vm->stack + base, 0, sizeof(lval *) * n);
+    vm->sp += n;
+
+    lval *x = NULL;
+    lval_jit.runs++;
+    if (((ljit_fn)code->native)(env, vm->stack + base)) {
+        x = vm->stack[base];
+    } else {
+        /* Drop what was computed, and let the form warm up again in case
+           its bindings changed for good */
+        for (int i = 0; i < n; i++) {
+            if (vm->stack[base + i]) {
+                lval_del(vm->stack[base + i]);
+            }
+        }
+        lval_jit.bails++;
+        ljit_free(code);
+        code->hits = ++code->bails < LJIT_MAX_BAILS ? 0 : -1;
+    }
+    vm->sp = base;
+    return x;
+}
+
+void ljit_print_stats(void) {
+    printf("jit: %s, %li compiled, %li refused, %li runs, %li bailed out\n",
+           lval_jit.enabled ? "on" : "off", lval_jit.compiled,
+           lval_jit.refused, lval_jit.runs, lval_jit.bails);
+}
+
+#endif
+
+/*
+ * eval nests lvm_eval calls on the C stack, so they count against the
+ * same limit as the frames of lval_eval. A call on the VM takes far more
+ * room than a frame, so nesting also stops once it has used LVM_STACK
+ * bytes of C stack, half the stack limit where it can be found.
+ */
+#ifndef LVM_STACK
+#define LVM_STACK (4 * 1024 * 1024)
+#endif
+
+static size_t lvm_stack_bytes(void) {
+#ifdef __unix__
+    struct rlimit r;
+    if (getrlimit(RLIMIT_STACK, &r) == 0 && r.rlim_cur != RLIM_INFINITY) {
+        return r.rlim_cur / 2;
+    }
+#endif
+    return LVM_STACK;
+}
+
+/* Evaluates 'v' like lval_eval, running S-expressions on the VM */
+lval *lvm_eval(lenv *env, lval *v) {
+    if (lval_type(v) != LVAL_SEXPR) {
+        return lval_eval(env, v);
+    }
+    lvm *vm = &lval_vm;
+#ifdef __GNUC__
+    uintptr_t sp = (uintptr_t)__builtin_frame_address(0);
+#else
+    uintptr_t sp = (uintptr_t)&vm;
+#endif
+    if (vm->depth == 0) {
+        vm->stack_base = sp;
+        if (vm->stack_bytes == 0) {
+            vm->stack_bytes = lvm_stack_bytes();
+        }
+    }
+    size_t used = vm->stack_base > sp ? vm->stack_base - sp
+                                      : sp - vm->stack_base;
+    if (vm->depth >= lval_stack.max_depth || used > vm->stack_bytes) {
+        lval_del(v);
+        return lval_err("Maximum evaluation depth exceeded!");
+    }
+    vm->depth++;
+    int owned;
+    int depth = lgc_enter(env, v);
+    lcode *code = lval_code(v, &owned);
+    lval *x = NULL;
+#ifdef LVAL_JIT
+    /* Only cached code lives long enough to get hot */
+    if (lval_jit.enabled && !owned) {
+        x = ljit_run(env, code, v);
+    }
+#endif
+    if (x == NULL) {
+        code->running++;
+        x = lvm_run(env, code);
+        code->running--;
+    }
+    if (owned) {
+        lcode_free(code);
+    }
+    lgc_leave(depth);
+    lval_del(v);
+    vm->depth--;
+    return x;
+}
+
+void lvm_destroy(void) {
+    lvm *vm = &lval_vm;
+    lmem_sub(LMEM_CODE, sizeof(lval *) * vm->capacity);
+    free(vm->stack);
+    vm->stack = NULL;
+    vm->capacity = 0;
+}
+
+#ifdef LVAL_GC
+
+/* Smallest number of live cells that triggers a collection */
+#ifndef LGC_MIN_HEAP
+#define LGC_MIN_HEAP 8192
+#endif
+
+typedef struct lgc {
+    /* Values held by evaluations in progress */
+    lval **roots;
+    int root_count;
+    int root_capacity;
+
+    long next_collection;  // Live cells that trigger the next collection
+
+    long collections;
+    long freed;
+    double pause_total;  // In milliseconds
+    double pause_max;
+} lgc;
+
+static lgc lval_gc = {NULL, 0, 0, LGC_MIN_HEAP};
+
+void lgc_root(lval *v) {
+    lgc *gc = &lval_gc;
+    if (gc->root_count == gc->root_capacity) {
+        lmem_sub(LMEM_GC, sizeof(lval *) * gc->root_capacity);
+        gc->root_capacity = gc->root_capacity ? gc->root_capacity * 2 : 64;
+        gc->roots = realloc(gc->roots, sizeof(lval *) * gc->root_capacity);
+        lmem_add(LMEM_GC, sizeof(lval *) * gc->root_capacity);
+    }
+    gc->roots[gc->root_count++] = v;
+}
+
+void lgc_mark(lval *v) {
+    while (!lval_is_fixnum(v) && !v->mark) {
+        v->mark = 1;
+        if ((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || !v->cell) {
+            return;
+        }
+        /* Every slot the buffer holds stays alive, not just this view */
+        lcells *c = lval_cells(v);
+        if (c->lo == c->hi) {
+            return;
+        }
+        for (int i = c->lo; i < c->hi - 1; i++) {
+            lgc_mark(c->slots[i]);
+        }
+        /* Loop on the last child to keep long lists off the C stack */
+        v = c->slots[c->hi - 1];
+    }
+}
+
+void lgc_sweep(void) {
+    lpool *p = &lval_pool;
+    for (lslab *s = p->slabs; s; s = s->next) {
+        /* Only the newest slab has uncarved slots at its end */
+        int used = s == p->slabs ? LVAL_SLAB_CELLS - p->fresh : LVAL_SLAB_CELLS;
+        for (int i = 0; i < used; i++) {
+            lval *v = &s->slots[i].val;
+            if (v->type == LSLOT_FREE) {
+                continue;
+            }
+            if (v->mark) {
+                v->mark = 0;
+                continue;
+            }
+            /* Children are swept on their own */
+            switch (v->type) {
+                case LVAL_ERR:
+                    lmem_sub(LMEM_ERROR, strlen(v->error) + 1);
+                    free(v->error);
+                    break;
+                case LVAL_SEXPR:
+                case LVAL_QEXPR:
+                    /* Slots are swept on their own */
+                    if (v->cell && --lval_cells(v)->refs == 0) {
+                        lcode_free(lval_cells(v)->code);
+                        lmem_sub(LMEM_CELLS,
+                                 lcells_size(lval_cells(v)->capacity));
+                        free(lval_cells(v));
+                    }
+                    break;
+            }
+            lval_free(v);
+            lval_gc.freed++;
+        }
+    }
+}
+
+void lgc_collect(lenv *env) {
+    lgc *gc = &lval_gc;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (env) {
+        for (lbind *b = env->binds; b; b = b->next) {
+            if (b->val) {
+                lgc_mark(b->val);
+            }
+        }
+    }
+    for (int i = 0; i < gc->root_count; i++) {
+        lgc_mark(gc->roots[i]);
+    }
+    for (int i = 0; i < lval_vm.sp; i++) {
+        if (lval_vm.stack[i]) {
+            lgc_mark(lval_vm.stack[i]);
+        }
+    }
+    for (int i = 0; i < lval_stack.count; i++) {
+        lgc_mark(lval_stack.frames[i].v);
+    }
+    lgc_sweep();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double pause = (end.tv_sec - start.tv_sec) * 1e3 +
+                   (end.tv_nsec - start.tv_nsec) / 1e6;
+    gc->collections++;
+    gc->pause_total += pause;
+    if (pause > gc->pause_max) {
+        gc->pause_max = pause;
+    }
+
+    /* Let the heap grow to twice what survived before collecting again */
+    gc->next_collection = lval_pool.live * 2;
+    if (gc->next_collection < LGC_MIN_HEAP) {
+        gc->next_collection = LGC_MIN_HEAP;
+    }
+}
+
+/* Collects if enough cells were allocated since the last collection */
+void lgc_safe_point(lenv *env) {
+    if (lval_pool.live >= lval_gc.next_collection) {
+        lgc_collect(env);
+    }
+}
+
+/* Safe point: roots 'v' and collects if needed */
+int lgc_enter(lenv *env, lval *v) {
+    int depth = lval_gc.root_count;
+    lgc_root(v);
+    lgc_safe_point(env);
+    return depth;
+}
+
+void lgc_leave(int depth) { lval_gc.root_count = depth; }
+
+void lgc_destroy(void) {
+    lgc *gc = &lval_gc;
+    lmem_sub(LMEM_GC, sizeof(lval *) * gc->root_capacity);
+    free(gc->roots);
+    gc->roots = NULL;
+    gc->root_count = 0;
+    gc->root_capacity = 0;
+}
+
+void lgc_print_stats(void) {
+    lgc *gc = &lval_gc;
+    printf("gc: %li collections, %li cells freed, heap %li bytes\n",
+           gc->collections, gc->freed,
+           lval_pool.slab_count * (long)sizeof(lslab));
+    printf("gc pauses: total %.3f ms, max %.3f ms, mean %.3f ms\n",
+           gc->pause_total, gc->pause_max,
+           gc->collections ? gc->pause_total / gc->collections : 0.0);
+}
+#endif
+
+/*!
+A little helper to check if the arguments are valid, returns an error or NULL
+*/
+lval *head_tail_helper(lval **args, int n) {
+    if (n != 1) {
+        return lval_err("Function 'head' passed too many arguments!");
+    }
+    if (lval_type(args[0]) != LVAL_QEXPR) {
+        return lval_err("Function 'head' passed incorrect types!");
+    }
+    if (args[0]->count == 0) {
+        return lval_err("Function 'head' passed {}!");
+    }
+    return NULL;
+}
+lval *builtin_list(lenv *env, lval *a) {
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+/* Checks the arguments of eval and returns the S-expression to evaluate,
+   or an error */
+lval *builtin_eval_expr(lval *a) {
+    LASSERT(a, a->count == 1, "Function 'eval' passed too many arguments!");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR,
+            "Function 'eval' passed incorrect type!");
+
+    lval *x = lval_unshare(lval_take(a, 0));
+    x->type = LVAL_SEXPR;
+    return x;
+}
+
+lval *builtin_eval(lenv *env, lval *a) {
+    lval *x = builtin_eval_expr(a);
+    if (lval_type(x) == LVAL_ERR) {
+        return x;
+    }
+    return lval_vm.enabled ? lvm_eval(env, x) : lval_eval(env, x);
+}
+/*
+Takes a Q-Expression and returns a Q-Expression with only the first element
+ */
+lval *builtin_head(lenv *env, lval *a) {
+    lval *err = head_tail_helper(a->cell, a->count);
+    if (err) {
+        lval_del(a);
+        return err;
+    }
+
+    lval *v = lval_unshare(lval_take(a, 0));
+    lval_truncate(v, 1);
+    return v;
+}
+
+lval *builtin_head_window(lenv *env, lval **args, int n) {
+    lval *err = head_tail_helper(args, n);
+    if (err) {
+        return err;
+    }
+    /* The window keeps its reference, so this shares the cells */
+    lval *v = lval_unshare(lval_retain(args[0]));
+    lval_truncate(v, 1);
+    return v;
+}
+
+/*
+Takes a Q-Expression and returns a Q-Expression with the first element removed
+*/
+lval *builtin_tail(lenv *env, lval *a) {
+    lval *err = head_tail_helper(a->cell, a->count);
+    if (err) {
+        lval_del(a);
+        return err;
+    }
+
+    lval *v = lval_unshare(lval_take(a, 0));
+    lval_del(lval_pop(v, 0));
+    return v;
+}
+
+lval *builtin_tail_window(lenv *env, lval **args, int n) {
+    lval *err = head_tail_helper(args, n);
+    if (err) {
+        return err;
+    }
+    lval *v = lval_unshare(lval_retain(args[0]));
+    lval_del(lval_pop(v, 0));
+    return v;
+}
+
+lval *builtin_join(lenv *env, lval *a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, lval_type(a->cell[i]) == LVAL_QEXPR,
+                "Function 'join' passed incorrect type");
+    }
+    lval *x = lval_pop(a, 0);
+    while (a->count) {
+        x = lval_join(x, lval_pop(a, 0));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_def(lenv *env, lval *a) {
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR,
+            "Function 'def' passed incorrect type!");
+
+    /* First argument is the list of symbols to bind */
+    lval *syms = a->cell[0];
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, lval_type(syms->cell[i]) == LVAL_SYM,
+                "Function 'def' cannot define non-symbol!");
+    }
+    LASSERT(a, syms->count == a->count - 1,
+            "Function 'def' cannot define incorrect number of values to "
+            "symbols!");
+
+    for (int i = 0; i < syms->count; i++) {
+        lenv_put(env, syms->cell[i], a->cell[i + 1]);
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/*
+Takes a Q-Expression of category names and returns {name live peak} for
+each, or for every category when it is empty. Sizes are in bytes
+ */
+lval *builtin_mem_stats(lenv *env, lval *a) {
+    LASSERT(a, a->count == 1,
+            "Function 'mem-stats' passed too many arguments!");
+    LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR,
+            "Function 'mem-stats' passed incorrect type!");
+
+    lval *names = a->cell[0];
+    for (int i = 0; i < names->count; i++) {
+        LASSERT(a, lval_type(names->cell[i]) == LVAL_SYM,
+                "Function 'mem-stats' passed incorrect type!");
+    }
+
+    /* Categories reported by this interpreter, then the totals and mpc */
+    const char *all[LMEM_COUNT + 2];
+    size_t live[LMEM_COUNT + 2];
+    size_t peak[LMEM_COUNT + 2];
+    mpc_mem_stats_t parser;
+    mpc_mem_stats(&parser);
+    for (int i = 0; i < LMEM_COUNT; i++) {
+        all[i] = lmem_names[i];
+        live[i] = lval_mem.live[i];
+        peak[i] = lval_mem.peak[i];
+    }
+    all[LMEM_COUNT] = "total";
+    live[LMEM_COUNT] = lval_mem.total;
+    peak[LMEM_COUNT] = lval_mem.total_peak;
+    all[LMEM_COUNT + 1] = "parser";
+    live[LMEM_COUNT + 1] = parser.live;
+    peak[LMEM_COUNT + 1] = parser.peak;
+
+    lval *x = lval_qexpr();
+    int n = names->count ? names->count : LMEM_COUNT + 2;
+    for (int i = 0; i < n; i++) {
+        int k = i;
+        if (names->count) {
+            const char *name = lsym_name(names->cell[i]->symid);
+            for (k = 0; k < LMEM_COUNT + 2; k++) {
+                if (strcmp(all[k], name) == 0) {
+                    break;
+                }
+            }
+            if (k == LMEM_COUNT + 2) {
+                lval_del(x);
+                lval_del(a);
+                return lval_err("Function 'mem-stats' passed unknown category!");
+            }
+        }
+        lval *row = lval_qexpr();
+        row = lval_add(row, lval_sym((char *)all[k]));
+        row = lval_add(row, lval_num(live[k]));
+        row = lval_add(row, lval_num(peak[k]));
+        x = lval_add(x, row);
+    }
+    lval_del(a);
+    return x;
+}
+
+static inline int lval_all_nums(lval **args, int n) {
+    for (int i = 0; i < n; i++) {
+        if (lval_type(args[i]) != LVAL_NUM) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Every arithmetic operator gets its own kernel, instantiated from
+ * LVAL_ARITH so the operation is fixed at compile time. Types are checked
+ * once up front and the common two argument call skips the loop. Work is
+ * done on plain longs and the result lval is only built at the end, the
+ * unsigned accumulator keeps overflow wrapping instead of undefined.
+ * Division by -1 negates for the same reason, as LONG_MIN / -1 traps.
+ *
+ * 'unary' is applied when there is a single argument, and 'step' folds
+ * the next argument 'y' into the accumulator 'x'. Each instance defines
+ * lval_op_NAME over borrowed arguments, and the builtin_NAME and
+ * builtin_NAME_window entry points on top of it.
+ */
+#define LVAL_ARITH(name, unary, step)                                 \
+    lval *lval_op_##name(lval **args, int n) {                        \
+        if (!lval_all_nums(args, n)) {                                \
+            return lval_err("Cannot operate on non-number!");         \
+        }                                                             \
+        unsigned long x = lval_to_num(args[0]);                       \
+        long y;                                                       \
+        if (n == 2) {                                                 \
+            y = lval_to_num(args[1]);                                 \
+            step;                                                     \
+            return lval_num(x);                                       \
+        }                                                             \
+        if (n == 1) {                                                 \
+            unary;                                                    \
+        }                                                             \
+        for (int i = 1; i < n; i++) {                                 \
+            y = lval_to_num(args[i]);                                 \
+            step;                                                     \
+        }                                                             \
+        return lval_num(x);                                           \
+    }                                                                 \
+                                                                      \
+    lval *builtin_##name(lenv *env, lval *a) {                        \
+        lval *x = lval_op_##name(a->cell, a->count);                  \
+        lval_del(a);                                                  \
+        return x;                                                     \
+    }                                                                 \
+                                                                      \
+    lval *builtin_##name##_window(lenv *env, lval **args, int n) {    \
+        return lval_op_##name(args, n);                               \
+    }
+
+LVAL_ARITH(add, , x += y)
+LVAL_ARITH(sub, x = -x, x -= y)
+LVAL_ARITH(mul, , x *= y)
+LVAL_ARITH(div, ,
+           if (y == 0) { return lval_err("Division By Zero!"); }
+           if (y == -1) { x = 0UL - x; } else { x = (long)x / y; })
+
+/* Window entry points take their arguments as borrowed values. They must
+   not evaluate anything, the window lives on the VM stack and would move */
+static const struct {
+    lbuiltin func;
+    lwindow win;
+    int flags;
+} lval_builtins[] = {
+    {builtin_head, builtin_head_window, LFN_PURE},
+    {builtin_tail, builtin_tail_window, LFN_PURE},
+    {builtin_list, NULL, LFN_PURE},
+    {builtin_join, NULL, LFN_PURE},
+    {builtin_eval, NULL, LFN_BINDS},
+    {builtin_def, NULL, LFN_BINDS},
+    {builtin_add, builtin_add_window, LFN_PURE},
+    {builtin_sub, builtin_sub_window, LFN_PURE},
+    {builtin_mul, builtin_mul_window, LFN_PURE},
+    {builtin_div, builtin_div_window, LFN_PURE},
+};
+
+static int lbuiltin_find(lbuiltin func) {
+    for (int i = 0; i < (int)(sizeof(lval_builtins) / sizeof(lval_builtins[0]));
+         i++) {
+        if (lval_builtins[i].func == func) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+lwindow lbuiltin_window(lbuiltin func) {
+    int i = lbuiltin_find(func);
+    return i < 0 ? NULL : lval_builtins[i].win;
+}
+
+int lbuiltin_flags(lbuiltin func) {
+    int i = lbuiltin_find(func);
+    return i < 0 ? 0 : lval_builtins[i].flags;
+}
+
+void lenv_add_builtin(lenv *env, char *name, lbuiltin func) {
     lval *k = lval_sym(name);
     lval *v = lval_func(func);
     lenv_put(env, k, v);
@@ -543,6 +3361,12 @@ void lenv_add_builtins(lenv *env) {
     lenv_add_builtin(env, "eval", builtin_eval);
     lenv_add_builtin(env, "join", builtin_join);
 
+    /* Variable Functions */
+    lenv_add_builtin(env, "def", builtin_def);
+
+    /* Memory Functions */
+    lenv_add_builtin(env, "mem-stats", builtin_mem_stats);
+
     /* Mathematical Functions */
     lenv_add_builtin(env, "+", builtin_add);
     lenv_add_builtin(env, "-", builtin_sub);
@@ -550,51 +3374,788 @@ void lenv_add_builtins(lenv *env) {
     lenv_add_builtin(env, "/", builtin_div);
 }
 
-int main(int argc, char **argv) {
-    mpc_parser_t *Number = mpc_new("number");
-    mpc_parser_t *Symbol = mpc_new("symbol");
-    mpc_parser_t *Sexpr = mpc_new("sexpr");
-    mpc_parser_t *Qexpr = mpc_new("qexpr");
-    mpc_parser_t *Expr = mpc_new("expr");
-    mpc_parser_t *Lispy = mpc_new("lispy");
-    mpca_lang(MPCA_LANG_DEFAULT,
-              "                                    \
+/* The grammar lval_read_n follows by hand */
+static const char *lispy_grammar = "                                    \
     number   : /-?[0-9]+/ ;                           \
     symbol   :  /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;                  \
     sexpr    : '(' <expr>* ')' ;                       \
     qexpr    : '{' <expr>* '}' ;                      \
     expr     : <number> | <symbol> | <sexpr> | <qexpr> ;        \
     lispy    : /^/  <expr>* /$/ ;                     \
-    ",
-              Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    ";
+
+/*
+ * Micro benchmarks, run with 'parsing --bench NAME'. They report time per
+ * operation so results can be compared across builds.
+ */
+static double lbench_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* Whether every symbol is bound to its index, or unbound if it is even
+   and 'removed' is set, looked up both through its cell and by name */
+static int lbench_env_check(lenv *env, lval **syms, int size, int removed) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < size; i++) {
+            if (pass) {
+                syms[i]->bind = NULL;
+            }
+            lval *x = lenv_get(env, syms[i]);
+            int ok = removed && i % 2 == 0
+                         ? lval_type(x) == LVAL_ERR
+                         : lval_type(x) == LVAL_NUM && lval_to_num(x) == i;
+            lval_del(x);
+            if (!ok) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Symbol lookup cost as the environment grows */
+void lbench_env(void) {
+    const int lookups = 4000000;
+    char name[32];
+
+    for (int size = 16; size <= 65536; size *= 4) {
+        lenv *env = lenv_new();
+        lval **syms = malloc(sizeof(lval *) * size);
+        for (int i = 0; i < size; i++) {
+            snprintf(name, sizeof(name), "bench_%d", i);
+            syms[i] = lval_sym(name);
+            lval *v = lval_num(i);
+            lenv_put(env, syms[i], v);
+            lval_del(v);
+        }
+
+        /* Forgetting the binding each time forces a lookup by name */
+        long sum = 0;
+        double start = lbench_now();
+        for (int i = 0; i < lookups; i++) {
+            lval *k = syms[(unsigned)i * 7919u % size];
+            k->bind = NULL;
+            lval *x = lenv_get(env, k);
+            sum += lval_to_num(x);
+            lval_del(x);
+        }
+        double by_name = (lbench_now() - start) / lookups;
+
+        start = lbench_now();
+        for (int i = 0; i < lookups; i++) {
+            lval *x = lenv_get(env, syms[(unsigned)i * 7919u % size]);
+            sum += lval_to_num(x);
+            lval_del(x);
+        }
+        double resolved = (lbench_now() - start) / lookups;
+
+        /* Unbind every other symbol, which shifts entries back in the
+           table, then bind them again */
+        start = lbench_now();
+        for (int i = 0; i < size; i += 2) {
+            lenv_remove(env, syms[i]);
+        }
+        double removed = (lbench_now() - start) / (size / 2);
+        int ok = lbench_env_check(env, syms, size, 1);
+        for (int i = 0; i < size; i += 2) {
+            lval *v = lval_num(i);
+            lenv_put(env, syms[i], v);
+            lval_del(v);
+        }
+        ok = ok && lbench_env_check(env, syms, size, 0);
+
+        printf("env size %6d: %6.2f ns by name, %6.2f ns resolved, "
+               "%6.2f ns remove, %s (checksum %li)\n",
+               size, by_name, resolved, removed,
+               ok ? "bindings ok" : "BINDINGS WRONG", sum);
+
+        for (int i = 0; i < size; i++) {
+            lval_del(syms[i]);
+        }
+        free(syms);
+        lenv_del(env);
+    }
+}
+
+/* Hardware event counter for the current thread, -1 if unavailable */
+static int lbench_counter_open(unsigned long config) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
 
-    puts("Lispy Version 0.0.0.3");
-    puts("Press CTRL+C to exit\n");
+static void lbench_counter_start(int fd) {
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static long lbench_counter_stop(int fd) {
+    long long count = 0;
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+    }
+#endif
+    return count;
+}
+
+/* Random (op e e ...) tree over the first 'ops' of + - * with numbers and
+   'x' as leaves */
+static lval *lbench_expr(int depth, int ops, unsigned *seed) {
+    static char *names[] = {"+", "-", "*"};
+    *seed = *seed * 1103515245u + 12345u;
+    unsigned r = *seed >> 16;
+    if (depth == 0 || r % 5 == 0) {
+        return r % 3 ? lval_num(r % 100) : lval_sym("x");
+    }
+    lval *v = lval_sexpr();
+    v = lval_add(v, lval_sym(names[r % ops]));
+    for (int i = 0; i < 2 + (int)(r >> 2) % 3; i++) {
+        v = lval_add(v, lbench_expr(depth - 1, ops, seed));
+    }
+    return v;
+}
+
+/* Evaluator dispatch: time and branch mispredictions per evaluation of
+   the same expression with lval_eval, the VM, its register mode and the
+   JIT */
+void lbench_dispatch(void) {
+    const int evals = 20000;
     lenv *env = lenv_new();
     lenv_add_builtins(env);
-    while (1) {
-        char *input = readline("lispy> ");
+    lval *k = lval_sym("x");
+    lval *v = lval_num(7);
+    lenv_put(env, k, v);
+    lval_del(k);
+    lval_del(v);
 
-        mpc_result_t r;
+    unsigned seed = 1;
+    lval *expr = lbench_expr(7, 3, &seed);
+    lval_resolve(env, expr);
+
+    int misses = lbench_counter_open(PERF_COUNT_HW_BRANCH_MISSES);
+    int branches = lbench_counter_open(PERF_COUNT_HW_BRANCH_INSTRUCTIONS);
+#ifdef LVM_THREADED
+    printf("vm dispatch: threaded\n");
+#else
+    printf("vm dispatch: switch\n");
+#endif
+    if (misses < 0 || branches < 0) {
+        printf("branch counters unavailable\n");
+    }
+
+    static const char *modes[] = {"tree", "vm", "regs", "jit"};
+#ifdef LVAL_JIT
+    const int last = 3;
+#else
+    const int last = 2;
+#endif
+    for (int vm = 0; vm <= last; vm++) {
+        lval *x = NULL;
+        lval_vm.registers = vm == 2;
+#ifdef LVAL_JIT
+        lval_jit.enabled = vm == 3;
+#endif
+        lbench_counter_start(misses);
+        lbench_counter_start(branches);
+        double start = lbench_now();
+        for (int i = 0; i < evals; i++) {
+            if (x) {
+                lval_del(x);
+            }
+            x = vm ? lvm_eval(env, lval_retain(expr))
+                   : lval_eval(env, lval_retain(expr));
+        }
+        double ns = (lbench_now() - start) / evals;
+        long b = lbench_counter_stop(branches);
+        long m = lbench_counter_stop(misses);
+
+        printf("%-4s: %9.1f ns per eval", modes[vm], ns);
+        if (misses >= 0 && branches >= 0) {
+            printf(", %8.1f branch misses per eval (%.2f%% of branches)",
+                   (double)m / evals, b ? 100.0 * m / b : 0.0);
+        }
+        printf(", result ");
+        lval_println(x);
+        lval_del(x);
+    }
+
+#ifdef __linux__
+    if (misses >= 0) {
+        close(misses);
+    }
+    if (branches >= 0) {
+        close(branches);
+    }
+#endif
+    lval_del(expr);
+    lenv_del(env);
+}
+
+#ifdef LVAL_JIT
+/* Forms that stay within fixnums, run by the VM's register mode and by
+   the JIT. The multiplications of the dispatch benchmark overflow into
+   boxed numbers, which the JIT leaves to the VM */
+void lbench_jit(void) {
+    const int evals = 200000;
+    lenv *env = lenv_new();
+    lenv_add_builtins(env);
+    lval *k = lval_sym("x");
+    lval *v = lval_num(7);
+    lenv_put(env, k, v);
+    lval_del(k);
+    lval_del(v);
+
+    unsigned seed = 1;
+    lval *exprs[2];
+    exprs[0] = lbench_expr(5, 2, &seed);
+    exprs[1] = lval_sexpr();
+    exprs[1] = lval_add(exprs[1], lval_sym("head"));
+    lval *l = lval_sexpr();
+    l = lval_add(l, lval_sym("tail"));
+    lval *q = lval_sexpr();
+    q = lval_add(q, lval_sym("list"));
+    for (int i = 0; i < 4; i++) {
+        q = lval_add(q, lval_sym("x"));
+    }
+    l = lval_add(l, q);
+    exprs[1] = lval_add(exprs[1], l);
+    static const char *names[] = {"arith", "list"};
 
-        /* Output our prompt and get input */
-        if (mpc_parse("<stdin>", input, Lispy, &r)) {
-            lval *x = lval_eval(env, lval_read(r.output));
+    lval_vm.registers = 1;
+    for (int e = 0; e < 2; e++) {
+        lval_resolve(env, exprs[e]);
+        for (int jit = 0; jit <= 1; jit++) {
+            lval *x = NULL;
+            lval_jit.enabled = jit;
+            double start = lbench_now();
+            for (int i = 0; i < evals; i++) {
+                if (x) {
+                    lval_del(x);
+                }
+                x = lvm_eval(env, lval_retain(exprs[e]));
+            }
+            double ns = (lbench_now() - start) / evals;
+            printf("%-5s %-4s: %8.1f ns per eval, result ", names[e],
+                   jit ? "jit" : "regs", ns);
             lval_println(x);
             lval_del(x);
+        }
+        lval_del(exprs[e]);
+    }
+    ljit_print_stats();
+    lenv_del(env);
+}
+#endif
+
+/* Whether 'a' and 'b' read the same */
+static int lbench_same(lval *a, lval *b) {
+    if (lval_type(a) != lval_type(b)) {
+        return 0;
+    }
+    switch (lval_type(a)) {
+        case LVAL_NUM:
+            return lval_to_num(a) == lval_to_num(b);
+        case LVAL_SYM:
+            return a->symid == b->symid;
+        case LVAL_ERR:
+            return strcmp(a->error, b->error) == 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (a->count != b->count) {
+                return 0;
+            }
+            for (int i = 0; i < a->count; i++) {
+                if (!lbench_same(a->cell[i], b->cell[i])) {
+                    return 0;
+                }
+            }
+            return 1;
+    }
+    return 0;
+}
+
+/* Reading a large line with mpc and lval_read, and with lval_read_n */
+void lbench_read(void) {
+    const int forms = 2000, reads = 10;
+    static const char *form =
+        "(def {total} (+ 1 (* x 23) (- -42 7) (head {list a_b c -4 {5}}))) ";
+    size_t n = strlen(form);
+    char *src = malloc(n * forms + 1);
+    for (int i = 0; i < forms; i++) {
+        memcpy(src + n * i, form, n);
+    }
+    src[n * forms] = '\0';
+
+    mpc_parser_t *Number = mpc_new("number");
+    mpc_parser_t *Symbol = mpc_new("symbol");
+    mpc_parser_t *Sexpr = mpc_new("sexpr");
+    mpc_parser_t *Qexpr = mpc_new("qexpr");
+    mpc_parser_t *Expr = mpc_new("expr");
+    mpc_parser_t *Lispy = mpc_new("lispy");
+    mpca_lang(MPCA_LANG_DEFAULT, lispy_grammar, Number, Symbol, Sexpr, Qexpr,
+              Expr, Lispy);
+    lval_tags_init();
+
+    /* mpc first, then the direct reader under each scanner kernel */
+    lval *ref = NULL;
+    int saved = lval_scan.classify ? lval_scan.level : 2;
+    for (int mode = -1; mode < LSCAN_LEVELS; mode++) {
+        const char *name = "mpc";
+        if (mode >= 0) {
+            if (lscan_init(mode) != mode) {
+                continue;
+            }
+            name = lscan_names[mode];
+        }
+        lval *x = NULL;
+        double start = lbench_now();
+        for (int i = 0; i < reads; i++) {
+            if (x) {
+                lval_del(x);
+            }
+            if (mode >= 0) {
+                x = lval_read_n(src, n * forms);
+                continue;
+            }
+            mpc_result_t r;
+            if (!mpc_parse("<bench>", src, Lispy, &r)) {
+                mpc_err_print(r.error);
+                mpc_err_delete(r.error);
+                x = lval_sexpr();
+                continue;
+            }
+            x = lval_read(r.output);
+            mpc_ast_delete(r.output);
+        }
+        double secs = (lbench_now() - start) / 1e9 / reads;
+        printf("%-6s: %8.2f ms per read, %7.1f MB/s", name, secs * 1e3,
+               n * forms / secs / 1e6);
+        if (ref) {
+            printf(", same as mpc: %s", lbench_same(ref, x) ? "yes" : "no");
+            lval_del(x);
+        } else {
+            ref = x;
+        }
+        printf("\n");
+    }
+    lscan_init(saved);
+    lval_del(ref);
+
+    /* Lines nested past LREAD_MAX_DEPTH are left to mpc */
+    static const int depths[] = {LREAD_MAX_DEPTH, LREAD_MAX_DEPTH + 1, 150000};
+    for (int i = 0; i < 3; i++) {
+        int d = depths[i];
+        char *line = malloc(2 * d + 2);
+        memset(line, '(', d);
+        line[d] = '1';
+        memset(line + d + 1, ')', d);
+        line[2 * d + 1] = '\0';
+
+        lval *x = lval_read_n(line, 2 * d + 1);
+        lval *y = NULL;
+        mpc_result_t r;
+        if (mpc_parse("<bench>", line, Lispy, &r)) {
+            y = lval_read(r.output);
             mpc_ast_delete(r.output);
+        } else {
+            mpc_err_delete(r.error);
+        }
+        int ok = x ? y && lbench_same(x, y) : d > LREAD_MAX_DEPTH;
+        printf("nested %6d deep: %s, mpc %s, %s\n", d,
+               x ? "read" : "left to mpc", y ? "reads it" : "rejects it",
+               ok ? "ok" : "WRONG");
+        if (x) {
+            lval_del(x);
+        }
+        if (y) {
+            lval_del(y);
+        }
+        free(line);
+    }
+
+    mpc_cleanup(6, Number, Symbol, Qexpr, Sexpr, Expr, Lispy);
+    mpc_tags_cleanup();
+    lval_reader_destroy();
+    free(src);
+}
+
+int lbench(const char *name) {
+    if (strcmp(name, "env") == 0) {
+        lbench_env();
+    } else if (strcmp(name, "dispatch") == 0) {
+        lbench_dispatch();
+    } else if (strcmp(name, "read") == 0) {
+        lbench_read();
+#ifdef LVAL_JIT
+    } else if (strcmp(name, "jit") == 0) {
+        lbench_jit();
+#endif
+    } else {
+        fprintf(stderr, "Unknown benchmark '%s'\n", name);
+        return 1;
+    }
+    lval_pool_destroy();
+    larena_destroy();
+    lsym_destroy();
+    return 0;
+}
 
+/* Reads, evaluates and prints the form in the 'n' characters at 'src',
+   which starts on line 'line' of 'name'. Returns 0 if it could not be
+   read */
+static int lval_run(lenv *env, mpc_parser_t *Lispy, const char *name,
+                    const char *src, size_t n, int line) {
+    mpc_result_t r;
+    int ok = 1;
+    larena_begin();
+    lval *x = lval_reader.mpc ? NULL : lval_read_n(src, n);
+    if (x == NULL) {
+        /* mpc reports whatever the direct reader rejected. It wants a
+           string of its own, 'src' may be a slice of a mapped file */
+        char *text = malloc(n + 1);
+        lmem_add(LMEM_AST, n + 1);
+        memcpy(text, src, n);
+        text[n] = '\0';
+        if (mpc_parse(name, text, Lispy, &r)) {
+            size_t ast = lmem_ast_size(r.output);
+            lmem_add(LMEM_AST, ast);
+            x = lval_read(r.output);
+            mpc_ast_delete(r.output);
+            lmem_sub(LMEM_AST, ast);
         } else {
+            r.error->state.row += line;
             mpc_err_print(r.error);
             mpc_err_delete(r.error);
+            ok = 0;
+        }
+        lmem_sub(LMEM_AST, n + 1);
+        free(text);
+    }
+    if (x) {
+        x = lval_fold(env, x);
+        lval_resolve(env, x);
+        x = lval_vm.enabled ? lvm_eval(env, x) : lval_eval(env, x);
+        lval_println(x);
+        lval_del(x);
+    }
+    larena_reset();
+    return ok;
+}
+
+/*
+ * Batch mode, 'parsing FILE...' or 'parsing -' for standard input. Each
+ * form is evaluated and freed as soon as it is complete, so only one form
+ * is held at a time. A form is a line like at the REPL, except that it
+ * carries on over newlines while a list is open. Blank lines are skipped.
+ *
+ * Regular files are mapped whole, and every form is a slice of the
+ * mapping that the reader takes symbols and numbers from in place. Only
+ * the name of a symbol seen for the first time is copied, into the symbol
+ * table, since it outlives the mapping. Pages behind the current form are
+ * given back as it goes. Anything else, such as a pipe, is read through a
+ * 64 KB buffer and each form is copied out of it.
+ */
+#define LSOURCE_CHUNK (64 * 1024)
+
+typedef struct lsource {
+    FILE *file;
+    const char *data;  // The mapping, or the chunk last read
+    size_t pos;
+    size_t len;
+    char *map;
+    size_t released;  // Bytes of the mapping given back
+    char *chunk;
+
+    const char *form;  // Text of the current form
+    size_t count;
+    char *buffer;  // Holds the form when it is not mapped
+    size_t capacity;
+
+    int line;       // Line the stream is on, from 0
+    int form_line;  // Line the current form started on
+} lsource;
+
+/* Maps the file behind 's', returns 0 to stream it instead */
+static int lsource_map(lsource *s) {
+#ifdef __unix__
+    struct stat st;
+    int fd = fileno(s->file);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return 0;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    s->map = p;
+    s->data = p;
+    s->len = st.st_size;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static void lsource_putc(lsource *s, char c) {
+    if (s->count == s->capacity) {
+        lmem_sub(LMEM_AST, s->capacity);
+        s->capacity = s->capacity ? s->capacity * 2 : 256;
+        s->buffer = realloc(s->buffer, s->capacity);
+        lmem_add(LMEM_AST, s->capacity);
+    }
+    s->buffer[s->count++] = c;
+}
+
+/* Finds the next form and points s->form at it, returns 0 at the end of
+   the stream */
+static int lsource_next(lsource *s) {
+    int depth = 0;
+    int blank = 1;
+    size_t start = s->pos;
+    size_t end = 0;
+    s->count = 0;
+    s->form_line = s->line;
+
+    while (1) {
+        if (s->pos == s->len) {
+            if (s->map) {
+                end = s->pos;
+                break;
+            }
+            s->pos = 0;
+            s->len = fread(s->chunk, 1, LSOURCE_CHUNK, s->file);
+            if (s->len == 0) {
+                break;
+            }
+        }
+        char c = s->data[s->pos++];
+        if (c == '\n') {
+            s->line++;
+            if (depth <= 0 && !blank) {
+                end = s->pos - 1;
+                break;
+            }
+            if (blank) {
+                start = s->pos;
+                s->count = 0;
+                s->form_line = s->line;
+                continue;
+            }
+        } else if (c == '(' || c == '{') {
+            depth++;
+        } else if (c == ')' || c == '}') {
+            depth--;
+        }
+        if (!lread_space(c)) {
+            blank = 0;
+        }
+        if (!s->map) {
+            lsource_putc(s, c);
+        }
+    }
+    if (s->map) {
+        s->form = s->map + start;
+        s->count = end - start;
+#ifdef __unix__
+        /* Nothing points into the mapping once a form is evaluated */
+        size_t done = start & ~(size_t)(LSOURCE_CHUNK - 1);
+        if (done > s->released) {
+            madvise(s->map + s->released, done - s->released, MADV_DONTNEED);
+            s->released = done;
+        }
+#endif
+    } else {
+        s->form = s->buffer;
+    }
+    return !blank;
+}
+
+/* Runs every form in 'path', '-' being standard input. Returns non-zero
+   if it could not be opened or a form could not be read */
+static int lval_run_file(lenv *env, mpc_parser_t *Lispy, const char *path) {
+    int from_stdin = strcmp(path, "-") == 0;
+    FILE *f = from_stdin ? stdin : fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    lsource *s = calloc(1, sizeof(lsource));
+    lmem_add(LMEM_AST, sizeof(lsource));
+    s->file = f;
+    if (from_stdin || !lsource_map(s)) {
+        s->chunk = malloc(LSOURCE_CHUNK);
+        s->data = s->chunk;
+        lmem_add(LMEM_AST, LSOURCE_CHUNK);
+    }
+    int status = 0;
+    while (lsource_next(s)) {
+        if (!lval_run(env, Lispy, from_stdin ? "<stdin>" : path, s->form,
+                      s->count, s->form_line)) {
+            status = 1;
+        }
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "Error reading '%s'\n", path);
+        status = 1;
+    }
+
+#ifdef __unix__
+    if (s->map) {
+        munmap(s->map, s->len);
+    }
+#endif
+    if (s->chunk) {
+        lmem_sub(LMEM_AST, LSOURCE_CHUNK);
+        free(s->chunk);
+    }
+    lmem_sub(LMEM_AST, sizeof(lsource) + s->capacity);
+    free(s->buffer);
+    free(s);
+    if (!from_stdin) {
+        fclose(f);
+    }
+    return status;
+}
+
+int main(int argc, char **argv) {
+    /* Scripts to run instead of the REPL */
+    char **files = malloc(sizeof(char *) * argc);
+    int file_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            free(files);
+            return lbench(argv[i + 1]);
+        } else if (strcmp(argv[i], "--vm") == 0) {
+            lval_vm.enabled = 1;
+        } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+            char *end;
+            long depth = strtol(argv[++i], &end, 10);
+            if (*argv[i] == '\0' || *end != '\0' || depth <= 0 ||
+                depth > INT_MAX) {
+                fprintf(stderr, "Invalid depth '%s' for --max-depth\n",
+                        argv[i]);
+                free(files);
+                return 1;
+            }
+            lval_stack.max_depth = depth;
+        } else if (strcmp(argv[i], "--no-fold") == 0) {
+            lval_fold_stats.disabled = 1;
+        } else if (strcmp(argv[i], "--vm-registers") == 0) {
+            lval_vm.enabled = 1;
+            lval_vm.registers = 1;
+        } else if (strcmp(argv[i], "--mpc-reader") == 0) {
+            lval_reader.mpc = 1;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            /* Forms run on the VM until they get hot */
+            lval_vm.enabled = 1;
+#ifdef LVAL_JIT
+            lval_jit.enabled = 1;
+#else
+            fprintf(stderr, "No JIT in this build, using the VM\n");
+#endif
+        } else if (strcmp(argv[i], "--bench") == 0 ||
+                   strcmp(argv[i], "--max-depth") == 0) {
+            /* Only reached when the value is missing */
+            fprintf(stderr, "Missing value for option '%s'\n", argv[i]);
+            free(files);
+            return 1;
+        } else if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0) {
+            files[file_count++] = argv[i];
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            free(files);
+            return 1;
+        }
+    }
+
+    mpc_parser_t *Number = mpc_new("number");
+    mpc_parser_t *Symbol = mpc_new("symbol");
+    mpc_parser_t *Sexpr = mpc_new("sexpr");
+    mpc_parser_t *Qexpr = mpc_new("qexpr");
+    mpc_parser_t *Expr = mpc_new("expr");
+    mpc_parser_t *Lispy = mpc_new("lispy");
+    mpca_lang(MPCA_LANG_DEFAULT, lispy_grammar, Number, Symbol, Sexpr, Qexpr,
+              Expr, Lispy);
+    lval_tags_init();
+
+    lenv *env = lenv_new();
+    lenv_add_builtins(env);
+    int status = 0;
+    for (int i = 0; i < file_count; i++) {
+        status |= lval_run_file(env, Lispy, files[i]);
+    }
+    if (file_count == 0) {
+        puts("Lispy Version 0.0.0.3");
+        puts("Press CTRL+C to exit\n");
+    }
+    while (file_count == 0) {
+        char *input = readline("lispy> ");
+        if (input == NULL) {
+            break;
+        }
+
+        /* REPL commands */
+        int command = 1;
+        if (strcmp(input, ":mem") == 0) {
+            lmem_print();
+        } else if (strcmp(input, ":fold") == 0) {
+            lval_fold_print_stats();
+#ifdef LVAL_JIT
+        } else if (strcmp(input, ":jit") == 0) {
+            ljit_print_stats();
+#endif
+        } else {
+            command = 0;
+        }
+        if (command) {
+            add_history(input);
+            free(input);
+            continue;
         }
 
+        lval_run(env, Lispy, "<stdin>", input, strlen(input), 0);
+
         /* Add input to history */
         add_history(input);
         free(input);
     }
     lenv_del(env);
     mpc_cleanup(6, Number, Symbol, Qexpr, Sexpr, Expr, Lispy);
+    mpc_tags_cleanup();
 
-    return 0;
+#ifdef LVAL_POOL_STATS
+    lval_pool_print_stats();
+#endif
+    lval_pool_destroy();
+    larena_destroy();
+    lvm_destroy();
+    lval_stack_destroy();
+    lval_reader_destroy();
+    lsym_destroy();
+    free(files);
+
+    return status;
 }
\ No newline at end of file